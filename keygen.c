@@ -2,12 +2,465 @@
 * keygen.c
 *
 * Author: Greg Mankes
-* Generates a key of specified length given over command line
+* Generates a key of specified length given over command line. With -s and
+* -d it instead serves keys from a pool of pads made ahead of time, and with
+* just -s it asks such a server for one
 *******************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include "otp_cipher.h"
+
+// how much of a binary key is read and written at a time
+#define CHUNK_SIZE (64 * 1024)
+// most pad sizes a pool keeps
+#define MAX_POOL_SIZES 16
+// how many pads of each size a pool keeps ready by default
+#define POOL_DEPTH 4
+// longest request line, a kind and a length
+#define REQUEST_SIZE 64
+// seconds a client of the pool server gets to send its request
+#define REQUEST_TIMEOUT 5
+
+// the directory the pool's pads live in
+char * pool_dir = NULL;
+// the sizes the pool keeps pads of, and how many of each
+long long pool_sizes[MAX_POOL_SIZES];
+int npool_sizes = 0;
+int pool_depth = POOL_DEPTH;
+// the alphabet of the pool's text pads, NULL when it keeps raw byte pads.
+// Text pads are not named by alphabet, a pool directory is for just one
+const struct alphabet * pool_alphabet = NULL;
+// makes the names of the pads this process creates unique
+unsigned long pad_counter = 0;
+
+/******************************************************************************
+* int write_key(int, long long, int)
+*
+* Writes a key of random data from the kernel's random number generator. A
+* binary key is the raw bytes with no trailing newline. A text key maps
+* bytes to the symbols of its alphabet, dropping the ones past the last
+* whole multiple of its size so each symbol is as likely as the others
+* args: where to write it, the key length and its alphabet, NULL for binary
+* returns: 0 on success, -1 if the key could not be written
+*******************************************************************************/
+int write_key(int out_fd, long long key_length, const struct alphabet * alphabet){
+	int binary = alphabet == NULL;
+	// the bytes below this many are kept
+	int limit = binary ? 256 : 256 / alphabet->size * alphabet->size;
+	unsigned char random[CHUNK_SIZE];
+	char buffer[CHUNK_SIZE];
+	int fd = open("/dev/urandom", O_RDONLY);
+	if(fd < 0){
+		return -1;
+	}
+	long long i = 0;
+	ssize_t n;
+	ssize_t j;
+	ssize_t nkey;
+	for(; i < key_length; i += nkey){
+		n = key_length - i < CHUNK_SIZE ? key_length - i : CHUNK_SIZE;
+		if((n = read(fd, random, n)) <= 0){
+			close(fd);
+			return -1;
+		}
+		if(binary){
+			memcpy(buffer, random, n);
+			nkey = n;
+		} else {
+			for(j = 0, nkey = 0; j < n; j++){
+				if(random[j] < limit){
+					buffer[nkey++] = alphabet->symbols[random[j] % alphabet->size];
+				}
+			}
+		}
+		if(write(out_fd, buffer, nkey) != nkey){
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	if(!binary && write(out_fd, "\n", 1) != 1){
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* void binary_key(long long)
+*
+* Writes a key of raw random bytes for binary mode, straight from the
+* kernel's random number generator and without a trailing newline
+* args: the key length
+*******************************************************************************/
+void binary_key(long long key_length){
+	if(write_key(STDOUT_FILENO, key_length, NULL) == -1){
+		fprintf(stderr, "Error writing key\n");
+		exit(1);
+	}
+}
+
+/******************************************************************************
+* void pad_path(char *, size_t, char *)
+*
+* Makes a new path in the pool for a pad, unique to this process
+* args: a buffer for the path, its size, and what the pad is for
+*******************************************************************************/
+void pad_path(char * path, size_t size, char * prefix){
+	snprintf(path, size, "%s/%s-%d-%lu", pool_dir, prefix, (int)getpid(),
+			pad_counter++);
+}
+
+/******************************************************************************
+* int make_pad(char *, long long, int)
+*
+* Generates a pad into a new file only this user can read
+* args: the path, the pad length and its alphabet, NULL for binary
+* returns: 0 on success, -1 if it could not be made
+*******************************************************************************/
+int make_pad(char * path, long long length, const struct alphabet * alphabet){
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if(fd < 0){
+		return -1;
+	}
+	if(write_key(fd, length, alphabet) == -1 || close(fd) == -1){
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* int ready_pad(char *, char *, long long *)
+*
+* Tells whether a file in the pool is a pad ready to hand out, and of what
+* kind and size. Ready pads are named ready-<kind>-<length>-<pid>-<n>
+* args: the file name, and where to put its kind and length
+* returns: 1 if it is a ready pad, 0 if not
+*******************************************************************************/
+int ready_pad(char * name, char * kind, long long * length){
+	int end = 0;
+	if(sscanf(name, "ready-%c-%lld-%*d-%*u%n", kind, length, &end) != 2 ||
+			end == 0 || name[end] != '\0'){
+		return 0;
+	}
+	return *kind == 't' || *kind == 'b';
+}
+
+/******************************************************************************
+* void refill_pool(int)
+*
+* Runs in its own process, keeping pool_depth pads of each pool size ready.
+* A pad is generated under a temporary name and renamed once it is whole,
+* so the server never hands out half of one. Goes around again whenever the
+* server says it handed a pad out, or every second in case another server
+* shares the directory
+* args: the end of the pipe the server wakes it up through
+*******************************************************************************/
+void refill_pool(int wake_fd){
+	char kind = pool_alphabet == NULL ? 'b' : 't';
+	char path[4096];
+	char ready[4096];
+	char wake[64];
+	struct pollfd pfd;
+	struct dirent * entry;
+	char pad_kind;
+	long long length;
+	int counts[MAX_POOL_SIZES];
+	int i;
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	pfd.fd = wake_fd;
+	pfd.events = POLLIN;
+	while(1){
+		// count what is ready
+		memset(counts, 0, sizeof(counts));
+		DIR * dir = opendir(pool_dir);
+		while(dir != NULL && (entry = readdir(dir)) != NULL){
+			if(!ready_pad(entry->d_name, &pad_kind, &length) || pad_kind != kind){
+				continue;
+			}
+			for(i = 0; i < npool_sizes; i++){
+				if(pool_sizes[i] == length){
+					counts[i]++;
+				}
+			}
+		}
+		if(dir != NULL){
+			closedir(dir);
+		}
+		// top it up, in the order the sizes were given
+		for(i = 0; i < npool_sizes; i++){
+			for(; counts[i] < pool_depth; counts[i]++){
+				pad_path(path, sizeof(path), ".tmp");
+				snprintf(ready, sizeof(ready), "%s/ready-%c-%lld-%d-%lu", pool_dir,
+						kind, pool_sizes[i], (int)getpid(), pad_counter++);
+				if(make_pad(path, pool_sizes[i], pool_alphabet) == -1 ||
+						rename(path, ready) == -1){
+					fprintf(stderr, "Error generating a pad in %s\n", pool_dir);
+					unlink(path);
+					break;
+				}
+			}
+		}
+		if(poll(&pfd, 1, 1000) > 0 && read(wake_fd, wake, sizeof(wake)) == 0){
+			// the server is gone
+			exit(0);
+		}
+	}
+}
+
+/******************************************************************************
+* int claim_pad(const struct alphabet *, long long, char *, size_t)
+*
+* Takes a pad of at least the length asked for out of the pool, the
+* smallest there is. A pad is claimed by renaming it, which only one
+* process can do, so no pad is ever handed out twice. A longer pad is cut
+* down to size. Without one in the pool, or when the pool's pads are of
+* another alphabet, a fresh pad is made on the spot
+* args: the pad's alphabet or NULL for binary, its length, and a buffer for
+*       the claimed pad's path
+* returns: 0 on success, -1 if there is no pad to be had
+*******************************************************************************/
+int claim_pad(const struct alphabet * alphabet, long long length, char * path,
+		size_t size){
+	char kind = alphabet == NULL ? 'b' : 't';
+	char best[4096];
+	char name[256];
+	struct dirent * entry;
+	char pad_kind;
+	long long pad_length;
+	long long best_length;
+	pad_path(path, size, "pad");
+	while(1){
+		best_length = -1;
+		DIR * dir = opendir(pool_dir);
+		if(dir == NULL){
+			return -1;
+		}
+		while(alphabet == pool_alphabet && (entry = readdir(dir)) != NULL){
+			if(ready_pad(entry->d_name, &pad_kind, &pad_length) &&
+					pad_kind == kind && pad_length >= length &&
+					(best_length == -1 || pad_length < best_length)){
+				best_length = pad_length;
+				snprintf(name, sizeof(name), "%s", entry->d_name);
+			}
+		}
+		closedir(dir);
+		if(best_length == -1){
+			return make_pad(path, length, alphabet);
+		}
+		snprintf(best, sizeof(best), "%s/%s", pool_dir, name);
+		if(rename(best, path) == 0){
+			break;
+		}
+		// someone else got it first, look again
+		if(errno != ENOENT){
+			return -1;
+		}
+	}
+	if(best_length == length){
+		return 0;
+	}
+	// a text pad keeps its newline at the end
+	int fd = open(path, O_WRONLY);
+	if(fd < 0 || ftruncate(fd, length) == -1 ||
+			(kind == 't' && pwrite(fd, "\n", 1, length) != 1)){
+		if(fd >= 0){
+			close(fd);
+		}
+		unlink(path);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/******************************************************************************
+* void serve_pool(char *)
+*
+* Serves pads from the pool on a unix domain socket, to this user only: the
+* socket is made accessible to no one else, and a peer of another user is
+* turned away anyway, in case the socket's directory lets them in. A request
+* is a line with the kind of pad, t for text or b for binary, its length, and
+* for text the name of its alphabet if not the default. The reply is a line
+* with the path of a pad that now belongs to the client, or nothing if there
+* was none to give. Clients are served one at a time, so one that does not
+* send its request in REQUEST_TIMEOUT seconds is hung up on
+* args: the socket path
+*******************************************************************************/
+void serve_pool(char * socket_path){
+	struct sockaddr_un addr;
+	char request[REQUEST_SIZE];
+	char path[4096];
+	char name[16];
+	char kind;
+	long long length;
+	const struct alphabet * alphabet;
+	int nfields;
+	struct ucred cred;
+	socklen_t cred_size;
+	struct timeval timeout = {REQUEST_TIMEOUT, 0};
+	int wake[2];
+	int sockfd;
+	int new_fd;
+	ssize_t n;
+	ssize_t nread;
+	mkdir(pool_dir, 0700);
+	// clients may not share our working directory
+	if((pool_dir = realpath(pool_dir, NULL)) == NULL){
+		fprintf(stderr, "Error opening the pool directory\n");
+		exit(1);
+	}
+	// pads half written when the last server stopped are of no use
+	DIR * dir = opendir(pool_dir);
+	struct dirent * entry;
+	if(dir == NULL){
+		fprintf(stderr, "Error opening %s\n", pool_dir);
+		exit(1);
+	}
+	while((entry = readdir(dir)) != NULL){
+		if(strncmp(entry->d_name, ".tmp-", 5) == 0){
+			snprintf(path, sizeof(path), "%s/%s", pool_dir, entry->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+	signal(SIGPIPE, SIG_IGN);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	unlink(socket_path);
+	// the socket is created with only our permissions, never briefly more
+	mode_t old_mask = umask(077);
+	if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+			bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(sockfd, 16) == -1){
+		fprintf(stderr, "Error listening on %s\n", socket_path);
+		exit(1);
+	}
+	umask(old_mask);
+	// refill in the background so handing out a pad never waits on one
+	if(pipe(wake) == -1){
+		fprintf(stderr, "Error in pipe\n");
+		exit(1);
+	}
+	pid_t pid = fork();
+	if(pid == -1){
+		fprintf(stderr, "Error in fork\n");
+		exit(1);
+	}
+	if(pid == 0){
+		close(sockfd);
+		close(wake[1]);
+		refill_pool(wake[0]);
+	}
+	close(wake[0]);
+	fcntl(wake[1], F_SETFL, O_NONBLOCK);
+	while(1){
+		if((new_fd = accept(sockfd, NULL, NULL)) == -1){
+			continue;
+		}
+		// pads are secrets, only our own user gets them
+		cred_size = sizeof(cred);
+		if(getsockopt(new_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) == -1 ||
+				cred.uid != geteuid()){
+			close(new_fd);
+			continue;
+		}
+		setsockopt(new_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		// read the request line
+		for(n = 0; n < REQUEST_SIZE - 1 && memchr(request, '\n', n) == NULL;
+				n += nread){
+			if((nread = recv(new_fd, request + n, REQUEST_SIZE - 1 - n, 0)) <= 0){
+				break;
+			}
+		}
+		request[n] = '\0';
+		nfields = sscanf(request, "%c %lld %15s", &kind, &length, name);
+		alphabet = kind == 'b' ? NULL :
+			nfields == 3 ? find_alphabet(name) : &alphabets[0];
+		if(nfields >= 2 && (kind == 't' || kind == 'b') && length >= 0 &&
+				(kind == 'b' || alphabet != NULL) &&
+				claim_pad(alphabet, length, path, sizeof(path)) == 0){
+			strcat(path, "\n");
+			send(new_fd, path, strlen(path), 0);
+			write(wake[1], "", 1);
+		}
+		close(new_fd);
+	}
+}
+
+/******************************************************************************
+* void request_pad(char *, long long, int, int)
+*
+* Gets a pad from a pool server. It is either written out like a generated
+* key and then removed, or left where it is and its path printed
+* args: the server's socket path, the key length, its alphabet or NULL for
+*       binary, and whether to print the path instead of the key
+*******************************************************************************/
+void request_pad(char * socket_path, long long key_length,
+		const struct alphabet * alphabet, int print_path){
+	struct sockaddr_un addr;
+	char path[4096];
+	char buffer[CHUNK_SIZE];
+	ssize_t n = 0;
+	ssize_t nread;
+	int sockfd;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+			connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+		fprintf(stderr, "Error connecting to %s\n", socket_path);
+		exit(1);
+	}
+	if(alphabet == NULL){
+		snprintf(buffer, sizeof(buffer), "b %lld\n", key_length);
+	} else {
+		snprintf(buffer, sizeof(buffer), "t %lld %s\n", key_length, alphabet->name);
+	}
+	send(sockfd, buffer, strlen(buffer), 0);
+	while(n < (ssize_t)sizeof(path) - 1 &&
+			(nread = recv(sockfd, path + n, sizeof(path) - 1 - n, 0)) > 0){
+		n += nread;
+	}
+	close(sockfd);
+	if(n == 0 || path[n - 1] != '\n'){
+		fprintf(stderr, "The pool had no key to give\n");
+		exit(1);
+	}
+	path[n - 1] = '\0';
+	if(print_path){
+		printf("%s\n", path);
+		return;
+	}
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		fprintf(stderr, "Error opening %s\n", path);
+		exit(1);
+	}
+	// the pad is ours alone, and used once
+	unlink(path);
+	while((nread = read(fd, buffer, sizeof(buffer))) > 0){
+		if(write(STDOUT_FILENO, buffer, nread) != nread){
+			fprintf(stderr, "Error writing key\n");
+			exit(1);
+		}
+	}
+	close(fd);
+}
 
 /******************************************************************************
 * int main(int, char *)
@@ -16,30 +469,92 @@
 * args: command line arguments
 *******************************************************************************/
 int main(int argc, char * argv[]){
+	// -b asks for a raw byte key, -A for a text key in another alphabet
+	int binary = 0;
+	const struct alphabet * alphabet = &alphabets[0];
+	// the pool server's socket, and whether to hand over the pad's path
+	char * socket_path = NULL;
+	int print_path = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "bs:d:n:fA:")) != -1){
+		switch(opt){
+			case 'b':
+				binary = 1;
+				break;
+			case 'A':
+				alphabet = find_alphabet(optarg);
+				if(alphabet == NULL){
+					fprintf(stderr, "Unknown alphabet %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'd':
+				pool_dir = optarg;
+				break;
+			case 'n':
+				pool_depth = atoi(optarg);
+				if(pool_depth < 1){
+					fprintf(stderr, "Invalid pool depth\n");
+					exit(1);
+				}
+				break;
+			case 'f':
+				print_path = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: keygen [-b | -A alphabet] [-s socketpath [-f]] <keylength>\n"
+						"       keygen -s socketpath -d pooldir [-n depth] [-b | -A alphabet] <keylength>...\n");
+				exit(1);
+		}
+	}
+	if(binary){
+		alphabet = NULL;
+	}
+	if(pool_dir != NULL){
+		if(socket_path == NULL || optind == argc || argc - optind > MAX_POOL_SIZES){
+			fprintf(stderr, "Usage: keygen -s socketpath -d pooldir [-n depth] [-b | -A alphabet] <keylength>...\n");
+			exit(1);
+		}
+		pool_alphabet = alphabet;
+		for(; optind < argc; optind++){
+			pool_sizes[npool_sizes] = strtoll(argv[optind], NULL, 10);
+			if(pool_sizes[npool_sizes] < 0){
+				fprintf(stderr, "Invalid key length %s\n", argv[optind]);
+				exit(1);
+			}
+			npool_sizes++;
+		}
+		serve_pool(socket_path);
+	}
 	// check the number of args
-	if(argc != 2){
-		fprintf(stderr, "Incorrect number of arguments\nUsage: keygen <keylength>");
+	if(argc - optind != 1){
+		fprintf(stderr, "Incorrect number of arguments\nUsage: keygen [-b] <keylength>");
 		exit(1);
 	}
 	// get the key length
-	int key_length = atoi(argv[1]);
+	long long key_length = strtoll(argv[optind], NULL, 10);
+	if(socket_path != NULL){
+		request_pad(socket_path, key_length, alphabet, print_path);
+		return 0;
+	}
+	if(binary){
+		binary_key(key_length);
+		return 0;
+	}
 	// seed random number generator
 	srand(time(0));
 	// set up loop var and key
-	int i = 0;
+	long long i = 0;
 	int key;
 	// begin generating keys
 	for(; i < key_length; i++){
 		// get a random number
-		key = rand() % 27;
-		// if the number is not 26, mapp it to a char
-		if(key != 26){
-			printf("%c", 'A'+(char)key);
-		}
-		else{
-			// if it is 26, it is a space
-			printf(" ");
-		}
+		key = rand() % alphabet->size;
+		// and print the symbol it stands for
+		printf("%c", alphabet->symbols[key]);
 	}
 	// print a newline
 	printf("\n");
@@ -0,0 +1,171 @@
+/*******************************************************************************
+ * mkalphabets.c
+ *
+ * Generates otp_alphabets.h from the alphabets in otp_alphabets.def. Each
+ * alphabet becomes three tables of 256 entries, indexed by byte, and a pair
+ * of cipher functions that go through them, so the cipher does no branching
+ * or modulo on the characters and every alphabet runs as fast as the
+ * others. Run by the Makefile before anything that includes otp_cipher.h
+ ******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+
+// longest alphabet name, so it fits the client's validation cache
+#define MAX_NAME_SIZE 15
+// the decode table holds every sum of two numbers, which must fit in a byte
+#define MAX_ALPHABET_SIZE 128
+// what a byte is in the valid tables, as otp_cipher.h has them
+#define ALPHABET_INVALID 0
+#define ALPHABET_SYMBOL 1
+#define ALPHABET_PASS 2
+
+struct definition {
+	const char * name;
+	const char * symbols;
+};
+
+static const struct definition definitions[] = {
+#define ALPHABET(name, symbols) { #name, symbols },
+#include "otp_alphabets.def"
+#undef ALPHABET
+};
+
+#define NDEFINITIONS (int)(sizeof(definitions) / sizeof(definitions[0]))
+
+/*******************************************************************************
+ * int check_definition(const struct definition *)
+ *
+ * Makes sure an alphabet can be made into tables: a short name, at least
+ * two symbols and not too many, none of them repeated or a newline
+ * Args: the alphabet
+ * Returns: 1 if it is fine, 0 if not
+ ******************************************************************************/
+int check_definition(const struct definition * def){
+	size_t size = strlen(def->symbols);
+	size_t i;
+	if(strlen(def->name) > MAX_NAME_SIZE){
+		fprintf(stderr, "Alphabet name %s is too long\n", def->name);
+		return 0;
+	}
+	if(size < 2 || size > MAX_ALPHABET_SIZE){
+		fprintf(stderr, "Alphabet %s must have 2 to %d symbols\n", def->name,
+				MAX_ALPHABET_SIZE);
+		return 0;
+	}
+	for(i = 0; i < size; i++){
+		if(def->symbols[i] == '\n' ||
+				strchr(def->symbols + i + 1, def->symbols[i]) != NULL){
+			fprintf(stderr, "Alphabet %s repeats a symbol or has a newline\n",
+					def->name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*******************************************************************************
+ * void print_table(FILE *, const char *, const char *, unsigned char *)
+ *
+ * Writes out a table of 256 bytes as a static array
+ * Args: the output, the alphabet's name, the table's name and its entries
+ ******************************************************************************/
+void print_table(FILE * out, const char * name, const char * table,
+		unsigned char * entries){
+	int i;
+	fprintf(out, "static const unsigned char %s_%s[256] = {", name, table);
+	for(i = 0; i < 256; i++){
+		fprintf(out, "%s%3d,", i % 16 == 0 ? "\n\t" : " ", entries[i]);
+	}
+	fprintf(out, "\n};\n\n");
+}
+
+/*******************************************************************************
+ * void print_alphabet(FILE *, const struct definition *)
+ *
+ * Writes out the tables and cipher functions of an alphabet
+ * Args: the output and the alphabet
+ ******************************************************************************/
+void print_alphabet(FILE * out, const struct definition * def){
+	unsigned char encode[256];
+	unsigned char decode[256];
+	unsigned char valid[256];
+	int size = strlen(def->symbols);
+	int i;
+	memset(encode, 0, sizeof(encode));
+	memset(decode, 0, sizeof(decode));
+	memset(valid, ALPHABET_INVALID, sizeof(valid));
+	for(i = 0; i < size; i++){
+		encode[(unsigned char)def->symbols[i]] = i;
+		valid[(unsigned char)def->symbols[i]] = ALPHABET_SYMBOL;
+	}
+	valid['\n'] = ALPHABET_PASS;
+	// a sum is below twice the size, and so is a difference with the size
+	// added, so wrapping them around is a lookup
+	for(i = 0; i < 2 * size; i++){
+		decode[i] = def->symbols[i % size];
+	}
+	fprintf(out, "// %s, %d symbols\nstatic const char %s_symbols[] = \"",
+			def->name, size, def->name);
+	for(i = 0; i < size; i++){
+		fprintf(out, def->symbols[i] == '"' || def->symbols[i] == '\\' ?
+				"\\%c" : "%c", def->symbols[i]);
+	}
+	fprintf(out, "\";\n\n");
+	print_table(out, def->name, "encode", encode);
+	print_table(out, def->name, "decode", decode);
+	print_table(out, def->name, "valid", valid);
+	fprintf(out, "static inline void %s_encrypt(char * message, char * key,\n"
+			"\t\tlong long message_length){\n"
+			"\tencrypt_text(message, key, message_length, %s_encode, %s_decode,\n"
+			"\t\t\t%s_valid);\n}\n\n", def->name, def->name, def->name, def->name);
+	fprintf(out, "static inline void %s_decrypt(char * message, char * key,\n"
+			"\t\tlong long message_length){\n"
+			"\tdecrypt_text(message, key, message_length, %s_encode, %s_decode,\n"
+			"\t\t\t%s_valid, %d);\n}\n\n", def->name, def->name, def->name,
+			def->name, size);
+}
+
+/*******************************************************************************
+ * int main(int, char *)
+ *
+ * Writes otp_alphabets.h, or nothing at all if an alphabet is no good
+ * Args: the path to write it to
+ ******************************************************************************/
+int main(int argc, char * argv[]){
+	int i;
+	if(argc != 2){
+		fprintf(stderr, "Usage: mkalphabets outfile\n");
+		return 1;
+	}
+	for(i = 0; i < NDEFINITIONS; i++){
+		if(!check_definition(&definitions[i])){
+			return 1;
+		}
+	}
+	FILE * out = fopen(argv[1], "w");
+	if(out == NULL){
+		fprintf(stderr, "Error opening %s\n", argv[1]);
+		return 1;
+	}
+	fprintf(out, "// Generated by mkalphabets from otp_alphabets.def, do not edit.\n"
+			"// Included by otp_cipher.h, which defines what it uses.\n"
+			"#ifndef OTP_ALPHABETS_H\n#define OTP_ALPHABETS_H\n\n");
+	for(i = 0; i < NDEFINITIONS; i++){
+		print_alphabet(out, &definitions[i]);
+	}
+	fprintf(out, "// the first is the default\n"
+			"static const struct alphabet alphabets[] = {\n");
+	for(i = 0; i < NDEFINITIONS; i++){
+		const char * name = definitions[i].name;
+		fprintf(out, "\t{ \"%s\", %s_symbols, %d, %s_encode, %s_decode, %s_valid,\n"
+				"\t\t%s_encrypt, %s_decrypt },\n", name, name,
+				(int)strlen(definitions[i].symbols), name, name, name, name, name);
+	}
+	fprintf(out, "};\n\n#endif\n");
+	if(fclose(out) != 0){
+		fprintf(stderr, "Error writing %s\n", argv[1]);
+		remove(argv[1]);
+		return 1;
+	}
+	return 0;
+}
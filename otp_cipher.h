@@ -0,0 +1,137 @@
+/*******************************************************************************
+ * otp_cipher.h
+ *
+ * The cipher itself, shared by the daemons and by the clients, which run it
+ * in place of a daemon for messages too small to be worth sending, and the
+ * alphabets text is written in, shared with keygen too
+ ******************************************************************************/
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+#include <string.h>
+
+// what a byte is in an alphabet's valid table
+#define ALPHABET_INVALID 0
+#define ALPHABET_SYMBOL 1
+// newlines are in no alphabet, and left as they are
+#define ALPHABET_PASS 2
+
+/*******************************************************************************
+ * struct alphabet
+ *
+ * An alphabet text can be written in, generated from otp_alphabets.def. The
+ * tables all have an entry for every byte
+ ******************************************************************************/
+struct alphabet {
+	const char * name;
+	const char * symbols;
+	int size;
+	// each byte's number in the alphabet, 0 for bytes not in it
+	const unsigned char * encode;
+	// the symbol of every number below twice the size, wrapped around
+	const unsigned char * decode;
+	// ALPHABET_SYMBOL, ALPHABET_PASS or ALPHABET_INVALID for each byte
+	const unsigned char * valid;
+	void (*encrypt)(char *, char *, long long);
+	void (*decrypt)(char *, char *, long long);
+};
+
+/*******************************************************************************
+ * void encrypt_text(char *, char *, long long, const unsigned char *,
+ *                   const unsigned char *, const unsigned char *)
+ *
+ * Encrypts a file with a specified key through an alphabet's tables. The
+ * sum of the numbers is looked up already wrapped around, and a newline
+ * is kept by a select rather than a branch. Each alphabet has its own copy
+ * with its tables built in, see otp_alphabets.h
+ * Args: the file as a string, the key, the message length and the tables
+ ******************************************************************************/
+static inline __attribute__((always_inline)) void encrypt_text(char * message,
+		char * key, long long message_length, const unsigned char * encode,
+		const unsigned char * decode, const unsigned char * valid){
+	long long i = 0;
+	unsigned char m;
+	unsigned char c;
+	for(; i < message_length; i++){
+		m = message[i];
+		c = decode[encode[m] + encode[(unsigned char)key[i]]];
+		message[i] = valid[m] == ALPHABET_PASS ? m : c;
+	}
+}
+
+/*******************************************************************************
+ * void decrypt_text(char *, char *, long long, const unsigned char *,
+ *                   const unsigned char *, const unsigned char *, int)
+ *
+ * decrypts a file with a specified key through an alphabet's tables, the
+ * size added to the difference keeping it from going below zero
+ * Args: the file as a string, the key, the message length, the tables and
+ *       the alphabet's size
+ ******************************************************************************/
+static inline __attribute__((always_inline)) void decrypt_text(char * message,
+		char * key, long long message_length, const unsigned char * encode,
+		const unsigned char * decode, const unsigned char * valid, int size){
+	long long i = 0;
+	unsigned char m;
+	unsigned char c;
+	for(; i < message_length; i++){
+		m = message[i];
+		c = decode[encode[m] - encode[(unsigned char)key[i]] + size];
+		message[i] = valid[m] == ALPHABET_PASS ? m : c;
+	}
+}
+
+#include "otp_alphabets.h"
+
+/*******************************************************************************
+ * const struct alphabet * find_alphabet(const char *)
+ *
+ * Looks an alphabet up by name
+ * Args: the name
+ * Returns: the alphabet, or NULL if there is none by that name
+ ******************************************************************************/
+static inline const struct alphabet * find_alphabet(const char * name){
+	size_t i = 0;
+	for(; i < sizeof(alphabets) / sizeof(alphabets[0]); i++){
+		if(strcmp(alphabets[i].name, name) == 0){
+			return &alphabets[i];
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+ * void xor_message(char *, char *, long long)
+ *
+ * XORs a message of arbitrary bytes with the key, which works the same both
+ * ways. The bulk of it goes 32 bytes at a time through vector registers,
+ * then 8 bytes at a time, then whatever bytes are left
+ * Args: the message, the key, and the message length
+ ******************************************************************************/
+static inline void xor_message(char * message, char * key,
+		long long message_length){
+	typedef unsigned long long vector __attribute__((vector_size(32)));
+	long long i = 0;
+	vector m;
+	vector k;
+	unsigned long long m64;
+	unsigned long long k64;
+	// the buffers need not be aligned, memcpy makes the loads safe
+	for(; i + (long long)sizeof(vector) <= message_length; i += sizeof(vector)){
+		memcpy(&m, message + i, sizeof(vector));
+		memcpy(&k, key + i, sizeof(vector));
+		m ^= k;
+		memcpy(message + i, &m, sizeof(vector));
+	}
+	for(; i + 8 <= message_length; i += 8){
+		memcpy(&m64, message + i, 8);
+		memcpy(&k64, key + i, 8);
+		m64 ^= k64;
+		memcpy(message + i, &m64, 8);
+	}
+	for(; i < message_length; i++){
+		message[i] ^= key[i];
+	}
+}
+
+#endif
@@ -7,13 +7,311 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include "otp_cipher.h"
+#include "otp_probes.h"
+
+// the op this daemon reports in its probes and trace, 'd' for decryption
+#define OTP_OP 'd'
+// the probes, all under the otp provider:
+//   accept(fd)                            a connection was accepted
+//   handshake(fd, op, valid)              the client was accepted or not
+//   header(fd, op, messagelength, keylength)  the lengths are in
+//   received(fd, op, length)              a message or key has arrived
+//   cipher-start(op, length), cipher-end(op, length)  around the cipher
+//   reply(fd, op, length)                 a result went out
+// size of the pieces large transfers are broken into
+#define CHUNK_SIZE (64 * 1024)
+// messages larger than this are spooled to disk rather than held in memory
+#define SPOOL_THRESHOLD (64LL * 1024 * 1024)
+// cipher threads hand out work in blocks that fit in a core's cache
+#define BLOCK_SIZE (64 * 1024)
+// how much of a large message is received per batch of cipher work
+#define SEGMENT_SIZE (4 * 1024 * 1024)
+// messages smaller than this are not worth splitting between threads
+#define PARALLEL_THRESHOLD (1024 * 1024)
+// longest job id a client can resume with
+#define JOB_ID_SIZE 32
+// how often the daemon looks for abandoned jobs, in seconds
+#define SWEEP_INTERVAL 60
+// how many buffers a worker's arena can hold, a request uses at most four
+#define ARENA_SLOTS 8
+// buffers at least this large are backed by huge pages when asked for
+#define HUGE_PAGE_THRESHOLD (4 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// messages at least this long are large jobs, which queue for a limited
+// number of slots so they cannot crowd out the small ones
+#define LARGE_THRESHOLD (16 * 1024 * 1024)
+// how many large jobs can be running or waiting at once
+#define SCHED_QUEUE 256
+// most NUMA nodes the daemon places work on
+#define MAX_NODES 64
+// memory policy that allocates on a given node while it has memory free
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+// the phases of a connection the watchdog keeps deadlines for, in the
+// order a connection goes through them
+#define PHASE_NONE 0
+#define PHASE_HANDSHAKE 1
+#define PHASE_QUEUED 2
+#define PHASE_RECEIVE 3
+#define PHASE_SEND 4
+// seconds over which a connection's throughput is measured
+#define THROUGHPUT_WINDOW 10
+// seconds a stream may go without moving a byte, it has no throughput floor
+#define STREAM_IDLE_LIMIT 300
+// the layout of trace records, bumped whenever it changes
+#define TRACE_VERSION 2
+// what a trace record says about how the request was made
+#define TRACE_XOR 1
+#define TRACE_JOB 2
+#define TRACE_FDS 4
+#define TRACE_CHUNKED 8
+#define TRACE_UNIX 16
+#define TRACE_INTERLEAVED 32
+// most pads that can be registered with -P and -K
+#define MAX_PADS 16
+// how many pages of a pad mincore is asked about at a time
+#define RESIDENCY_BATCH 65536
+
+/*******************************************************************************
+ * struct scheduler
+ *
+ * The queue large jobs wait in for a slot, shared between every process of
+ * the daemon. The smallest waiting job goes first, unless some have waited
+ * longer than the age limit, in which case the one waiting longest does
+ ******************************************************************************/
+struct sched_entry {
+	pid_t pid;
+	long long size;
+	time_t since;
+};
+struct scheduler {
+	pthread_mutex_t lock;
+	// broadcast whenever a slot frees up
+	pthread_cond_t turn;
+	pid_t running[SCHED_QUEUE];
+	int nrunning;
+	struct sched_entry waiting[SCHED_QUEUE];
+	int nwaiting;
+};
+
+/*******************************************************************************
+ * struct trace_record
+ *
+ * What the trace keeps of each request, in host byte order. otp_replay
+ * reads these back, the two have to agree on the layout
+ ******************************************************************************/
+struct trace_record {
+	// when the request came in and how long it took, in nanoseconds
+	uint64_t arrival;
+	uint64_t duration;
+	int64_t message_length;
+	int64_t key_length;
+	// the client's IPv4 address in network byte order, or its user id when
+	// it came in on the unix domain socket
+	uint32_t client;
+	// 'e' for encryption, 'd' for decryption
+	uint8_t op;
+	uint8_t flags;
+	uint16_t version;
+	// the name of the alphabet of a text request, empty for XOR
+	char alphabet[16];
+};
+
+/*******************************************************************************
+ * struct arena
+ *
+ * The buffers a worker receives messages and keys into, kept from one
+ * request to the next instead of being allocated and freed every time
+ ******************************************************************************/
+struct arena_buffer {
+	char * data;
+	long long size;
+	int in_use;
+};
+struct arena {
+	struct arena_buffer buffers[ARENA_SLOTS];
+	// how much the free buffers add up to
+	long long retained;
+};
+
+/*******************************************************************************
+ * struct pad
+ *
+ * A pad registered when the daemon starts, mapped for as long as it runs so
+ * its pages are read in before a request needs them. Requests that pass the
+ * same file as their key use this mapping instead of one of their own
+ ******************************************************************************/
+struct pad {
+	char * path;
+	dev_t dev;
+	ino_t ino;
+	long long size;
+	char * data;
+	// whether it was asked to be, and is, locked in memory
+	int locked;
+};
+
+/*******************************************************************************
+ * struct request
+ *
+ * What a client asked for in the handshake beyond its name
+ ******************************************************************************/
+struct request {
+	// the id of a resumable job, empty for a plain request
+	char job[JOB_ID_SIZE + 1];
+	// whether the message and key are raw bytes to XOR
+	int binary;
+	// whether the client passes its files instead of sending them
+	int fds;
+	// whether the message comes in frames, its length not known up front
+	int chunked;
+	// whether the message and key come in turns, a chunk of each at a time
+	int interleaved;
+	// the alphabet of a text message and key
+	const struct alphabet * alphabet;
+};
+
+/*******************************************************************************
+ * struct cipher_pool
+ *
+ * The threads a large request is decrypted with. Each batch of work is split
+ * into blocks and every thread is given a range of them. A thread that
+ * finishes its own range steals the remaining blocks of the others, so one
+ * slow thread does not hold up the batch
+ ******************************************************************************/
+struct cipher_pool {
+	pthread_t * threads;
+	int nthreads;
+	pthread_mutex_t lock;
+	// signalled when a batch is posted, and when the last thread finishes it
+	pthread_cond_t work;
+	pthread_cond_t done;
+	unsigned long generation;
+	int busy;
+	// whether a batch was posted and not yet waited for
+	int posted;
+	// the batch being worked on
+	char * message;
+	char * key;
+	long long length;
+	// the next and one past the last block of each thread's range
+	long long * next;
+	long long * end;
+};
+
+// how many cipher threads to use for large requests, 1 does it inline
+int cipher_threads = 1;
+// the pool of this request, started the first time it is needed
+struct cipher_pool pool;
+// where resumable jobs are kept, and for how many seconds after their
+// client was last heard from
+char * job_dir = NULL;
+int job_grace = 300;
+// how long in seconds requests in flight get to finish on shutdown
+int drain_seconds = 30;
+// the daemon's first process, which every request process descends from
+pid_t daemon_pid = 0;
+// the children handling requests right now
+pid_t * children = NULL;
+int nchildren = 0;
+int children_size = 0;
+// SIGCHLD, SIGTERM and SIGUSR1 are written here for the accept loop to
+// pick up
+int signal_pipe[2];
+// how many long-lived workers to run, 0 to fork a child per request
+int workers = 0;
+// set in a worker when it is told to finish up
+volatile sig_atomic_t worker_stop = 0;
+// this process's buffers, how much of them to keep between requests, and
+// whether to back large ones with huge pages
+struct arena arena;
+long long arena_cap = 256LL * 1024 * 1024;
+int arena_huge_pages = 0;
+// the queue for large jobs, what counts as one, how many run at once and
+// how long in seconds one waits before it goes ahead of smaller ones
+struct scheduler * sched = NULL;
+long long large_threshold = LARGE_THRESHOLD;
+int large_slots = 2;
+int age_limit = 10;
+// a worker's listening sockets, and whether this is a child a worker handed
+// a large job to
+int * worker_listeners = NULL;
+int worker_nlisteners = 0;
+int large_child = 0;
+// whether this process holds a slot for a large job, and will give it up
+// when it exits
+int sched_entered = 0;
+int sched_registered = 0;
+// the file requests are recorded in, -1 when they are not
+int trace_fd = -1;
+// the CPUs the daemon may run on, whether to keep work and its memory on
+// one NUMA node, the CPUs of each node, and how many workers have been
+// placed so far
+cpu_set_t allowed_cpus;
+int numa_placement = 0;
+cpu_set_t node_cpus[MAX_NODES];
+int nnodes = 0;
+int nplaced = 0;
+// how the request being handled combines the message with the key, set
+// once the handshake says which mode it is in
+void (*cipher)(char *, char *, long long) = NULL;
+// how many seconds a connection gets for each phase and in all, 0 for no
+// limit, and how many bytes a second it has to keep sending us while we
+// receive its data, 0 for no floor. Only the handshake has a deadline unless
+// asked, it is announced at startup and -D 0 turns it off. Waiting in the
+// queue for large jobs is on us, not the client, so it has no limit and does
+// not count towards the total
+int phase_limits[PHASE_SEND + 1] = {0, 10, 0, 0, 0};
+int total_limit = 0;
+long long min_throughput = 0;
+// the watchdog's view of the connection being handled: its phase, when
+// that and the connection started, how many bytes it has moved, and where
+// the current throughput window started
+volatile sig_atomic_t phase = PHASE_NONE;
+time_t phase_start;
+time_t total_start;
+volatile long long moved = 0;
+long long window_moved;
+time_t window_start;
+// whether the connection is a stream, which goes at the pace of whatever
+// feeds or reads the client
+volatile sig_atomic_t streaming = 0;
+// the connection being handled, which a worker's watchdog shuts down
+// instead of exiting
+volatile sig_atomic_t request_fd = -1;
+// how many stalled connections have been reaped, by any process
+unsigned long * stalled = NULL;
+// the pads registered with -P and -K
+struct pad pads[MAX_PADS];
+int npads = 0;
 
 /*******************************************************************************
  * struct addrinfo * create_address_info(char*)
@@ -52,7 +350,7 @@ struct addrinfo * create_address_info(char * port){
  ******************************************************************************/
 int create_socket(struct addrinfo * res){
 	int sockfd;
-	if ((sockfd = socket((struct addrinfo *)(res)->ai_family, res->ai_socktype, res->ai_protocol)) == -1){
+	if ((sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1){
 		fprintf(stderr, "Error in creating socket\n");
 		exit(1);
 	}
@@ -102,40 +400,315 @@ void listen_socket(int sockfd){
 }
 
 /*******************************************************************************
- * void send_file(int, char *, int)
+ * int create_unix_socket(char *)
+ * 
+ * Creates a unix domain socket bound to a path on the local host and listens
+ * on it, so local clients can skip the TCP/IP stack
+ * Args: the path of the socket
+ * Returns: a listening socket file descriptor
+ ******************************************************************************/
+int create_unix_socket(char * path){
+	struct sockaddr_un addr;
+	int sockfd;
+	// make sure the path fits in the address
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "Socket path is too long: %s\n", path);
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+		fprintf(stderr, "Error in creating socket\n");
+		exit(1);
+	}
+	// remove a stale socket left by a previous daemon
+	unlink(path);
+	if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+		close(sockfd);
+		fprintf(stderr, "Error in binding socket\n");
+		exit(1);
+	}
+	listen_socket(sockfd);
+	return sockfd;
+}
+
+/*******************************************************************************
+ * time_t monotonic_seconds()
+ *
+ * Returns: the seconds on a clock that is not set back and forth
+ ******************************************************************************/
+time_t monotonic_seconds(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/*******************************************************************************
+ * void on_watchdog(int)
+ *
+ * Checks the connection being handled once a second, and reaps it when it
+ * has gone past the deadline of its phase or its total deadline, or sent us
+ * too little over the last throughput window while we receive its data.
+ * What we send goes at the pace of whoever reads the client's output, so
+ * the floor is not held against it. A stream may pause for as long as its
+ * producer or reader likes, so a stream is only reaped once it has moved
+ * nothing at all for STREAM_IDLE_LIMIT seconds. A reaped connection is
+ * counted. A process forked for it exits with status 3, a worker shuts the
+ * connection down so the request fails and the worker goes on to the next
+ * Args: the signal number
+ ******************************************************************************/
+void on_watchdog(int signo){
+	static const char * const deadlines[] = {"", "handshake deadline", "",
+		"receive deadline", "send deadline"};
+	const char * reason = NULL;
+	int saved = errno;
+	time_t now = monotonic_seconds();
+	if(phase == PHASE_NONE || phase == PHASE_QUEUED){
+		return;
+	}
+	if(phase_limits[phase] > 0 && now - phase_start >= phase_limits[phase]){
+		reason = deadlines[phase];
+	}
+	else if(total_limit > 0 && now - total_start >= total_limit){
+		reason = "total deadline";
+	}
+	else if(streaming){
+		if(moved != window_moved){
+			window_moved = moved;
+			window_start = now;
+		}
+		else if(now - window_start >= STREAM_IDLE_LIMIT){
+			reason = "idle stream";
+		}
+	}
+	else if(phase == PHASE_RECEIVE && min_throughput > 0 &&
+			now - window_start >= THROUGHPUT_WINDOW){
+		if(moved - window_moved < min_throughput * (now - window_start)){
+			reason = "too slow";
+		}
+		window_moved = moved;
+		window_start = now;
+	}
+	if(reason != NULL){
+		__atomic_add_fetch(stalled, 1, __ATOMIC_RELAXED);
+		// only what is safe in a signal handler
+		if(write(STDERR_FILENO, "Reaped stalled connection: ", 27) == -1 ||
+				write(STDERR_FILENO, reason, strlen(reason)) == -1 ||
+				write(STDERR_FILENO, "\n", 1) == -1){
+		}
+		if(workers == 0 || large_child){
+			_Exit(3);
+		}
+		// reaped once, whatever it is doing fails as soon as it touches the
+		// connection
+		phase = PHASE_NONE;
+		shutdown(request_fd, SHUT_RDWR);
+	}
+	errno = saved;
+}
+
+/*******************************************************************************
+ * void watchdog_arm()
+ *
+ * Has the watchdog check on this process's connection every second. A
+ * forked child has to do this again, timers do not survive a fork
+ ******************************************************************************/
+void watchdog_arm(){
+	struct sigaction sa;
+	struct itimerval every = {{1, 0}, {1, 0}};
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_watchdog;
+	sigemptyset(&sa.sa_mask);
+	// reads and writes carry on where they were
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, NULL);
+	setitimer(ITIMER_REAL, &every, NULL);
+}
+
+/*******************************************************************************
+ * void set_phase(int)
+ *
+ * Moves the connection on to a later phase, starting its deadline and a
+ * fresh throughput window. Time spent queued is taken off the total
+ * Args: the phase
+ ******************************************************************************/
+void set_phase(int next){
+	time_t now = monotonic_seconds();
+	if(next <= phase){
+		return;
+	}
+	if(phase == PHASE_QUEUED){
+		total_start += now - phase_start;
+	}
+	phase_start = now;
+	window_start = now;
+	window_moved = moved;
+	phase = next;
+}
+
+/*******************************************************************************
+ * void watchdog_start()
+ *
+ * Starts watching a new connection, in its handshake
+ ******************************************************************************/
+void watchdog_start(){
+	phase = PHASE_NONE;
+	moved = 0;
+	streaming = 0;
+	total_start = monotonic_seconds();
+	set_phase(PHASE_HANDSHAKE);
+	watchdog_arm();
+}
+
+/*******************************************************************************
+ * void watchdog_stop()
+ *
+ * Stops watching, the connection is done with
+ ******************************************************************************/
+void watchdog_stop(){
+	struct itimerval never;
+	memset(&never, 0, sizeof(never));
+	phase = PHASE_NONE;
+	setitimer(ITIMER_REAL, &never, NULL);
+}
+
+/*******************************************************************************
+ * int send_file(int, char *, long long)
  *
  * Sends a file over a socket
  * Args: a socket file descriptor, a string and the length of the string
+ * Returns: 0 on success, -1 if the connection failed
  ******************************************************************************/
-void send_file(int new_fd, const char * message, int message_length){
+int send_file(int new_fd, const char * message, long long message_length){
 	// keep track of the loop var and the bytes wrote
-	int nwrote = 0;
-	int i = 0;
+	ssize_t nwrote = 0;
+	long long i = 0;
+	set_phase(PHASE_SEND);
 	// begin sending the file back
 	for (; i < message_length; i+=nwrote){
-		nwrote = write(new_fd, message, message + i);
+		nwrote = write(new_fd, message + i, message_length - i);
 		if(nwrote < 0){
 			fprintf(stderr, "Error in writing to socket\n");
-			_Exit(2);
+			return -1;
 		}
+		moved += nwrote;
 	}
+	PROBE3(reply, new_fd, OTP_OP, message_length);
 	// receive the done response
 	char buff[20];
 	memset(buff, 0, sizeof(buff));
 	recv(new_fd, buff, sizeof(buff), 0);
+	return 0;
+}
+
+/*******************************************************************************
+ * int send_spool(int, int, long long, long long)
+ *
+ * Sends the contents of a spool file from an offset to its end over a socket
+ * without reading it into memory, the chunked counterpart of send_file
+ * Args: a socket file descriptor, the spool file descriptor, the offset to
+ *       start at and the length of the spool
+ * Returns: 1 if the client confirmed it got everything, 0 if not, -1 if the
+ *          connection failed
+ ******************************************************************************/
+int send_spool(int new_fd, int spool_fd, long long start, long long message_length){
+	// keep track of the offset in the spool and the number of bytes wrote
+	off_t offset = start;
+	ssize_t nwrote;
+	set_phase(PHASE_SEND);
+	// let the kernel copy from the page cache to the socket
+	while(offset < message_length){
+		nwrote = sendfile(new_fd, spool_fd, &offset, message_length - offset);
+		if(nwrote <= 0){
+			fprintf(stderr, "Error in writing to socket\n");
+			return -1;
+		}
+		moved += nwrote;
+	}
+	PROBE3(reply, new_fd, OTP_OP, message_length - start);
+	// receive the done response
+	char buff[20];
+	memset(buff, 0, sizeof(buff));
+	return recv(new_fd, buff, sizeof(buff), 0) > 0;
+}
+
+/*******************************************************************************
+ * int parse_options(char *, struct request *)
+ *
+ * Reads the space separated options a client sent after its name:
+ *   job=<id>  resumable request, <id> being up to 32 hex digits
+ *   xor       the message and key are arbitrary bytes, XORed together
+ *   fds       the message, key and output are passed as file descriptors
+ *   chunked   the message is of unknown length and comes in frames
+ *   interleaved  the message and key come a chunk of each at a time
+ *   alphabet=<name>  the text is in that alphabet instead of the default
+ * Args: the options and the request to fill in
+ * Returns: 1 if they were all understood, 0 if not
+ ******************************************************************************/
+int parse_options(char * options, struct request * req){
+	char * save;
+	char * option = strtok_r(options, " ", &save);
+	for(; option != NULL; option = strtok_r(NULL, " ", &save)){
+		if(strncmp(option, "job=", 4) == 0){
+			// the id names files, so keep it to hex digits
+			size_t length = strlen(option + 4);
+			if(length == 0 || length > JOB_ID_SIZE ||
+					strspn(option + 4, "0123456789abcdef") != length){
+				return 0;
+			}
+			strcpy(req->job, option + 4);
+		}
+		else if(strcmp(option, "xor") == 0){
+			req->binary = 1;
+		}
+		else if(strcmp(option, "fds") == 0){
+			req->fds = 1;
+		}
+		else if(strcmp(option, "chunked") == 0){
+			req->chunked = 1;
+		}
+		else if(strcmp(option, "interleaved") == 0){
+			req->interleaved = 1;
+		}
+		else if(strncmp(option, "alphabet=", 9) == 0){
+			if((req->alphabet = find_alphabet(option + 9)) == NULL){
+				return 0;
+			}
+		}
+		else{
+			return 0;
+		}
+	}
+	// there is nothing to resume when nothing is sent, and a stream is
+	// neither resumed nor passed as a file
+	int streamed = req->chunked + req->interleaved;
+	return !(req->fds && req->job[0] != '\0') && streamed <= 1 &&
+		!(streamed && (req->fds || req->job[0] != '\0'));
 }
 
 /*******************************************************************************
- * int handshake(int)
+ * int handshake(int, struct request *)
  *
  * Completes a handshake with a client of the same type
- * Args: a socket file descriptor
+ * Args: a socket file descriptor and the request to fill in with any
+ *       options the client asked for
  ******************************************************************************/
-int handshake(int new_fd){
-	char buffer[20];
+int handshake(int new_fd, struct request * req){
+	char buffer[100];
 	memset(buffer, 0, sizeof(buffer));
+	memset(req, 0, sizeof(*req));
+	req->alphabet = &alphabets[0];
 	// receive the name of the client
-	recv(new_fd, buffer, sizeof(buffer),0);
+	recv(new_fd, buffer, sizeof(buffer) - 1,0);
+	// anything after the name asks for more than a plain request
+	char * option = strchr(buffer, ' ');
+	if(option != NULL){
+		*option++ = '\0';
+		if(!parse_options(option, req)){
+			return 0;
+		}
+	}
 	// accept clients of the same type
 	if(strcmp(buffer, "opt_dec") == 0){
 		return 1;
@@ -144,26 +717,168 @@ int handshake(int new_fd){
 }
 
 /*******************************************************************************
- * char * recv_file(int, int)
+ * char * arena_get(long long)
  *
- * Receives a file of a specified size and returns its contents in a string
- * Args: a socket file descriptor and a message length
+ * Gets a page aligned buffer of at least the given size from the arena,
+ * reusing the smallest free one that fits. Buffers are only mapped when none
+ * fits, so a worker that has seen its requests' sizes before allocates
+ * nothing and touches no fresh pages. Large buffers are backed by huge pages
+ * when the daemon is asked to use them
+ * Args: the size needed
+ * Returns: the buffer, to be given back with arena_put, or NULL if there is
+ *          no room for it
  ******************************************************************************/
-char * recv_file(int new_fd, int message_length){
-	// keep track of the loop var and bytes read
-	int nread = 0;
-	int i = 0;
-	// allocate a string for the file
-	char * to_receive = malloc(message_length * sizeof(char));
-	memset(to_receive, '\0', sizeof(to_receive));
-	// begin receiving the file
-	for(; i< message_length; i+= nread){
-		nread = read(new_fd, to_receive + i, message_length -i);
-		if(nread < 0){
+char * arena_get(long long size){
+	struct arena_buffer * best = NULL;
+	struct arena_buffer * empty = NULL;
+	int i;
+	for(i = 0; i < ARENA_SLOTS; i++){
+		struct arena_buffer * b = &arena.buffers[i];
+		if(b->data == NULL){
+			if(empty == NULL){
+				empty = b;
+			}
+		}
+		else if(!b->in_use && b->size >= size &&
+				(best == NULL || b->size < best->size)){
+			best = b;
+		}
+	}
+	if(best != NULL){
+		best->in_use = 1;
+		arena.retained -= best->size;
+		return best->data;
+	}
+	for(i = 0; i < ARENA_SLOTS && empty == NULL; i++){
+		// every slot is taken, make room by dropping a free buffer too small
+		// to be of use
+		struct arena_buffer * b = &arena.buffers[i];
+		if(!b->in_use){
+			munmap(b->data, b->size);
+			arena.retained -= b->size;
+			b->data = NULL;
+			empty = b;
+		}
+	}
+	if(empty == NULL){
+		fprintf(stderr, "Error: buffer arena is full\n");
+		return NULL;
+	}
+	// round up to pages, or to huge pages for large buffers
+	long long page = sysconf(_SC_PAGESIZE);
+	int huge = arena_huge_pages && size >= HUGE_PAGE_THRESHOLD;
+	if(huge){
+		page = HUGE_PAGE_SIZE;
+	}
+	long long rounded = size > 0 ? (size + page - 1) / page * page : page;
+	char * data = MAP_FAILED;
+	if(huge){
+		// reserved huge pages first, then transparent ones
+		data = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(data == MAP_FAILED){
+			data = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(data != MAP_FAILED){
+				madvise(data, rounded, MADV_HUGEPAGE);
+			}
+		}
+	}
+	else{
+		data = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if(data == MAP_FAILED){
+		fprintf(stderr, "Error allocating %lld bytes\n", size);
+		return NULL;
+	}
+	empty->data = data;
+	empty->size = rounded;
+	empty->in_use = 1;
+	return data;
+}
+
+/*******************************************************************************
+ * void arena_put(char *)
+ *
+ * Gives a buffer back to the arena. Free buffers are kept for the next
+ * request, largest ones unmapped first while they add up to more than the
+ * retention cap
+ * Args: the buffer from arena_get
+ ******************************************************************************/
+void arena_put(char * data){
+	int i;
+	for(i = 0; i < ARENA_SLOTS; i++){
+		if(arena.buffers[i].data == data){
+			arena.buffers[i].in_use = 0;
+			arena.retained += arena.buffers[i].size;
+			break;
+		}
+	}
+	while(arena.retained > arena_cap){
+		struct arena_buffer * largest = NULL;
+		for(i = 0; i < ARENA_SLOTS; i++){
+			struct arena_buffer * b = &arena.buffers[i];
+			if(b->data != NULL && !b->in_use &&
+					(largest == NULL || b->size > largest->size)){
+				largest = b;
+			}
+		}
+		munmap(largest->data, largest->size);
+		arena.retained -= largest->size;
+		largest->data = NULL;
+		largest->size = 0;
+	}
+}
+
+/*******************************************************************************
+ * int recv_all(int, char *, long long)
+ *
+ * Reads exactly the given number of bytes from a socket
+ * Args: a socket file descriptor, a buffer and the number of bytes to read
+ * Returns: 0 on success, -1 if the connection failed
+ ******************************************************************************/
+int recv_all(int new_fd, char * buffer, long long length){
+	ssize_t nread = 0;
+	long long i = 0;
+	for(; i < length; i += nread){
+		nread = read(new_fd, buffer + i, length - i);
+		// the client going away part way through is an error too
+		if(nread <= 0){
 			fprintf(stderr, "Error in receiving file\n");
-			_Exit(2);
+			return -1;
+		}
+		moved += nread;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+ * char * recv_file(int, long long, long long)
+ *
+ * Receives a file of a specified size and returns the first keep bytes of
+ * its contents in a string, the rest is read and thrown away
+ * Args: a socket file descriptor, a message length and how much to keep
+ * Returns: the string, or NULL if the request failed
+ ******************************************************************************/
+char * recv_file(int new_fd, long long message_length, long long keep){
+	// get a buffer for the incoming file
+	char * to_receive = arena_get(keep);
+	// begin receiving the file
+	if(to_receive == NULL || recv_all(new_fd, to_receive, keep) == -1){
+		return NULL;
+	}
+	// drain whatever is past the part we need
+	char discard[CHUNK_SIZE];
+	long long i = keep;
+	long long n;
+	for(; i < message_length; i += n){
+		n = message_length - i < CHUNK_SIZE ? message_length - i : CHUNK_SIZE;
+		if(recv_all(new_fd, discard, n) == -1){
+			return NULL;
 		}
 	}
+	PROBE3(received, new_fd, OTP_OP, message_length);
 	// echo finished response
 	char * finished = "opt_enc_d f";
 	send(new_fd, finished, strlen(finished),0);
@@ -171,164 +886,2338 @@ char * recv_file(int new_fd, int message_length){
 }
 
 /*******************************************************************************
- * void decrypt_message(char *, char *, int)
+ * int create_spool_file()
  *
- * decrypts a file with a specified key
- * Args: the file as a string, the key, and the message length
+ * Creates an unlinked temporary file to hold a message too large to keep in
+ * memory. It lives in $TMPDIR, or /tmp when that is not set
+ * Returns: the spool file descriptor, or -1 if it could not be created
  ******************************************************************************/
-void decrypt_message(char * message, char * key, int message_length){
-	int i = 0;
-	int message_num;
-	int key_num;
-	int result_num;
-	int alphabet = 27; // because of newline
-	for (; i < message_length; i++){
-		// ignore newlines
-		if (message[i] != '\n'){
-			// convert the characters of key[i] and message[i]
-			// to the range of 0 to 26
-			if(message[i] == ' '){
-				message_num = 26;
-			}
-			else{
-				message_num = message[i] -'A';
-			}
-			if(key[i] == ' '){
-				key_num = 26;
-			}
-			else{
-				key_num = key[i] - 'A';
-			}
-			// once converted, add them and mod by the alphabet
-			result_num = (message_num - key_num + alphabet) % alphabet;
-			// place the result in the string.
-			if(result_num == 26){
-				message[i] = ' ';
-			}
-			else{
-				message[i] = 'A' + (char)result_num;
-			}
-		}
+int create_spool_file(){
+	char path[4096];
+	char * dir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/otp_dec_d.XXXXXX",
+			dir != NULL ? dir : "/tmp");
+	int spool_fd = mkstemp(path);
+	if(spool_fd == -1){
+		fprintf(stderr, "Error creating spool file in %s\n", path);
+		return -1;
 	}
+	// nobody else needs the name, the file goes away with the descriptor
+	unlink(path);
+	return spool_fd;
 }
 
 /*******************************************************************************
- * void handle_request(int)
- * 
- * Handles the request from the client
- * Args: the newly created socket from the request
+ * int recv_spool(int, int, long long, long long)
+ *
+ * Receives a file of a specified size into a spool file, one chunk at a time,
+ * starting from an offset when the start of it is already there
+ * Args: a socket file descriptor, the spool file descriptor, the offset to
+ *       start at and the length
+ * Returns: 0 on success, -1 if the request failed
  ******************************************************************************/
-void handle_request(int new_fd){
-	int correct_client = handshake(new_fd);
-	if (!correct_client){
-		fprintf(stderr, "Invalid Client\n");
-		char invalid[] = "Invalid";
-		send(new_fd, invalid, strlen(invalid),0);
-		_Exit(2);
+int recv_spool(int new_fd, int spool_fd, long long start, long long message_length){
+	char chunk[CHUNK_SIZE];
+	long long i = start;
+	long long n;
+	for(; i < message_length; i += n){
+		n = message_length - i < CHUNK_SIZE ? message_length - i : CHUNK_SIZE;
+		if(recv_all(new_fd, chunk, n) == -1){
+			return -1;
+		}
+		if(pwrite(spool_fd, chunk, n, i) != n){
+			fprintf(stderr, "Error writing spool file\n");
+			return -1;
+		}
 	}
-	char valid[] = "Valid";
-	send(new_fd, valid, strlen(valid), 0);
-	// get the length of how long the file is
-	char buffer[10];
-	memset(buffer, 0, sizeof(buffer));
-	recv(new_fd, buffer, sizeof(buffer), 0);
-	int message_length = atoi(buffer);
-	// send the length of the file back
-	send(new_fd, buffer, strlen(buffer),0);
-	// get the length of the key
-	memset(buffer, 0, sizeof(buffer));
-	recv(new_fd, buffer, sizeof(buffer), 0);
-	int key_length = atoi(buffer);
-	// send the length of the key back
-	send(new_fd, buffer, strlen(buffer),0);
-	// get the message
-	char * message = recv_file(new_fd, message_length);
-	// get the key
-	char * key = recv_file(new_fd, key_length);
-	decrypt_message(message, key, message_length);
-	// send back the file
-	send_file(new_fd, message, message_length);
-	// free the key and message
-	free(message);
-	free(key);
-	exit(0);
+	PROBE3(received, new_fd, OTP_OP, message_length - start);
+	// echo finished response
+	char * finished = "opt_enc_d f";
+	send(new_fd, finished, strlen(finished),0);
+	return 0;
 }
 
+/*******************************************************************************
+ * void run_cipher(char *, char *, long long)
+ *
+ * Runs the cipher of the request in this thread, between the cipher probes
+ * Args: the message, the key, and the message length
+ ******************************************************************************/
+void run_cipher(char * message, char * key, long long message_length){
+	PROBE2(cipher__start, OTP_OP, message_length);
+	cipher(message, key, message_length);
+	PROBE2(cipher__end, OTP_OP, message_length);
+}
 
 /*******************************************************************************
- * void wait_for_connection
- * 
- * waits for a new connection to the server
- * Args: the file descriptor to wait on
+ * void * cipher_thread(void *)
+ *
+ * Runs one of the cipher threads: waits for a batch, works through its own
+ * range of blocks, then steals from the other threads' ranges
+ * Args: the index of the thread in the pool
  ******************************************************************************/
-void wait_for_connection(int sockfd){
-	// create a container for the connection
-	struct sockaddr_storage their_addr;
-	// create a size for the connection
-    socklen_t addr_size;
-	// create a new file descriptor for the connection
-	int new_fd;
-	// status variable
-	int status;
-	// pid variable;
-	pid_t pid;
-	// run forever
+void * cipher_thread(void * arg){
+	int id = (int)(long)arg;
+	unsigned long seen = 0;
+	int v;
+	long long b;
+	long long start;
+	long long length;
 	while(1){
-		// get the address size
-		addr_size = sizeof(their_addr);
-		// accept a new client
-		new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &addr_size);
-		// if there is no new client keep waiting
-		if(new_fd == -1){
-			fprintf(stderr, "Error in accepting connection\n");
-			continue;
+		// wait for a new batch
+		pthread_mutex_lock(&pool.lock);
+		while(pool.generation == seen){
+			pthread_cond_wait(&pool.work, &pool.lock);
 		}
-		// fork to let a new process handle the new socket
-		pid = fork();
-		// if there was an error, say so
-		if(pid == -1){
-			fprintf(stderr, "Error in fork\n");
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+		// start with our own range, then go round the others
+		for(v = 0; v < pool.nthreads; v++){
+			int victim = (id + v) % pool.nthreads;
+			while((b = __atomic_fetch_add(&pool.next[victim], 1,
+							__ATOMIC_RELAXED)) < pool.end[victim]){
+				start = b * BLOCK_SIZE;
+				length = pool.length - start < BLOCK_SIZE ?
+					pool.length - start : BLOCK_SIZE;
+				cipher(pool.message + start, pool.key + start, length);
+			}
 		}
-		else if(pid == 0){
-			// child process
-			close(sockfd);
-			handle_request(new_fd);
-			close(new_fd);
+		// let the submitter know when the whole batch is done
+		pthread_mutex_lock(&pool.lock);
+		if(--pool.busy == 0){
+			pthread_cond_signal(&pool.done);
 		}
-		else{
-			// parent process
-			close(new_fd);
-			while (pid > 0){
-				pid = waitpid(-1, &status, WNOHANG);
-			}
+		pthread_mutex_unlock(&pool.lock);
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+ * void cipher_pool_start()
+ *
+ * Starts the cipher threads if there are to be any and they are not running.
+ * When they cannot all be started, the request goes on with those that were,
+ * or inline if none were
+ ******************************************************************************/
+void cipher_pool_start(){
+	int i;
+	if(cipher_threads < 2 || pool.nthreads > 0){
+		return;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.threads = malloc(cipher_threads * sizeof(pthread_t));
+	pool.next = malloc(cipher_threads * sizeof(long long));
+	pool.end = malloc(cipher_threads * sizeof(long long));
+	if(pool.threads == NULL || pool.next == NULL || pool.end == NULL){
+		fprintf(stderr, "Error allocating cipher threads\n");
+		return;
+	}
+	// the threads only look at the count once a batch is posted
+	pool.nthreads = cipher_threads;
+	for(i = 0; i < cipher_threads; i++){
+		if(pthread_create(&pool.threads[i], NULL, cipher_thread,
+					(void *)(long)i) != 0){
+			fprintf(stderr, "Error creating cipher thread\n");
+			pool.nthreads = i;
+			break;
 		}
 	}
 }
 
 /*******************************************************************************
- * int main(int, char*)
- * 
- * main method. sets up server socket, command line args and calls 
- * wait_for_connection
- * Args: the command lin args
+ * void cipher_wait()
+ *
+ * Waits for the batch the cipher threads are working on, if any
  ******************************************************************************/
-int main(int argc, char *argv[]){
-	if(argc != 2){
-		fprintf(stderr, "Invalid number of arguments\n");
-		exit(1);
+void cipher_wait(){
+	if(pool.nthreads == 0){
+		return;
 	}
-	printf("Server open on port %s\n", argv[1]);
-	// create address info with the port number
-	struct addrinfo * res = create_address_info(argv[1]);
-	// create socket with this address info
-	int sockfd = create_socket(res);
-	// bind this socket to the port
-	bind_socket(sockfd, res);
-	// listen on the port
-   	listen_socket(sockfd);
-	// wait for up to 5 incoming connections
-	wait_for_connection(sockfd);
-	// clean up
-	freeaddrinfo(res);
+	pthread_mutex_lock(&pool.lock);
+	while(pool.busy > 0){
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	if(pool.posted){
+		pool.posted = 0;
+		PROBE2(cipher__end, OTP_OP, pool.length);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*******************************************************************************
+ * void cipher_submit(char *, char *, long long)
+ *
+ * Hands a batch to the cipher threads and returns without waiting for it,
+ * so the caller can receive the next batch meanwhile. Only one batch is in
+ * flight at a time. Without cipher threads the batch is done inline
+ * Args: the message, the key and the length of the batch
+ ******************************************************************************/
+void cipher_submit(char * message, char * key, long long length){
+	int i;
+	if(pool.nthreads == 0){
+		run_cipher(message, key, length);
+		return;
+	}
+	cipher_wait();
+	long long nblocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	pthread_mutex_lock(&pool.lock);
+	pool.message = message;
+	pool.key = key;
+	pool.length = length;
+	// give each thread an even share of the blocks to start with
+	for(i = 0; i < pool.nthreads; i++){
+		pool.next[i] = nblocks * i / pool.nthreads;
+		pool.end[i] = nblocks * (i + 1) / pool.nthreads;
+	}
+	pool.busy = pool.nthreads;
+	pool.generation++;
+	pool.posted = 1;
+	PROBE2(cipher__start, OTP_OP, length);
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
 }
 
+/*******************************************************************************
+ * int decrypt_spooled(int, long long, long long)
+ *
+ * Receives a message into a spool file, then decrypts it in place one key
+ * segment at a time as the key arrives and sends it back, so no buffer
+ * larger than a segment is ever allocated. With cipher threads, each segment
+ * is decrypted while the next one is being received
+ * Args: a socket file descriptor, the message length and the key length
+ * Returns: 0 on success, -1 if the request failed
+ ******************************************************************************/
+int decrypt_spooled(int new_fd, long long message_length, long long key_length){
+	int spool_fd = create_spool_file();
+	if(spool_fd == -1){
+		return -1;
+	}
+	// get the message
+	if(recv_spool(new_fd, spool_fd, 0, message_length) == -1){
+		close(spool_fd);
+		return -1;
+	}
+	cipher_pool_start();
+	long long segment = pool.nthreads > 0 ? SEGMENT_SIZE : CHUNK_SIZE;
+	// get the key a segment at a time and apply it to the spooled message,
+	// with two sets of buffers so one can be received while the other is
+	// being decrypted
+	char * message[2];
+	char * key[2];
+	long long offset[2];
+	long long length[2];
+	int s;
+	int pending = -1;
+	for(s = 0; s < 2; s++){
+		message[s] = arena_get(segment);
+		key[s] = arena_get(segment);
+		if(message[s] == NULL || key[s] == NULL){
+			close(spool_fd);
+			return -1;
+		}
+	}
+	long long i = 0;
+	long long n;
+	for(s = 0; i < message_length; i += n, s = !s){
+		n = message_length - i < segment ? message_length - i : segment;
+		if(recv_all(new_fd, key[s], n) == -1){
+			close(spool_fd);
+			return -1;
+		}
+		offset[s] = i;
+		length[s] = n;
+		if(pread(spool_fd, message[s], length[s], i) != length[s]){
+			fprintf(stderr, "Error reading spool file\n");
+			close(spool_fd);
+			return -1;
+		}
+		// write out the previous segment once it is done
+		cipher_wait();
+		if(pending != -1 && pwrite(spool_fd, message[pending], length[pending],
+					offset[pending]) != length[pending]){
+			fprintf(stderr, "Error writing spool file\n");
+			close(spool_fd);
+			return -1;
+		}
+		cipher_submit(message[s], key[s], length[s]);
+		pending = s;
+	}
+	// drain the part of the key past the message, which is not needed
+	char discard[CHUNK_SIZE];
+	for(; i < key_length; i += n){
+		n = key_length - i < CHUNK_SIZE ? key_length - i : CHUNK_SIZE;
+		if(recv_all(new_fd, discard, n) == -1){
+			close(spool_fd);
+			return -1;
+		}
+	}
+	cipher_wait();
+	if(pending != -1 && pwrite(spool_fd, message[pending], length[pending],
+				offset[pending]) != length[pending]){
+		fprintf(stderr, "Error writing spool file\n");
+		close(spool_fd);
+		return -1;
+	}
+	PROBE3(received, new_fd, OTP_OP, key_length);
+	// echo finished response
+	char * finished = "opt_enc_d f";
+	send(new_fd, finished, strlen(finished),0);
+	for(s = 0; s < 2; s++){
+		arena_put(message[s]);
+		arena_put(key[s]);
+	}
+	// send back the file
+	int sent = send_spool(new_fd, spool_fd, 0, message_length);
+	close(spool_fd);
+	return sent == -1 ? -1 : 0;
+}
+
+/*******************************************************************************
+ * char * recv_key_and_decrypt(int, char *, long long, long long)
+ *
+ * Receives the key a segment at a time and has the cipher threads decrypt
+ * the message with each segment while the next one arrives
+ * Args: a socket file descriptor, the message, its length and the key length
+ * Returns: the part of the key that was used, or NULL if the request failed
+ ******************************************************************************/
+char * recv_key_and_decrypt(int new_fd, char * message, long long message_length,
+		long long key_length){
+	char * key = arena_get(message_length);
+	if(key == NULL){
+		return NULL;
+	}
+	long long i = 0;
+	long long n;
+	for(; i < message_length; i += n){
+		n = message_length - i < SEGMENT_SIZE ? message_length - i : SEGMENT_SIZE;
+		if(recv_all(new_fd, key + i, n) == -1){
+			return NULL;
+		}
+		cipher_submit(message + i, key + i, n);
+	}
+	// drain whatever is past the part we need
+	char discard[CHUNK_SIZE];
+	for(; i < key_length; i += n){
+		n = key_length - i < CHUNK_SIZE ? key_length - i : CHUNK_SIZE;
+		if(recv_all(new_fd, discard, n) == -1){
+			return NULL;
+		}
+	}
+	PROBE3(received, new_fd, OTP_OP, key_length);
+	// echo finished response
+	char * finished = "opt_enc_d f";
+	send(new_fd, finished, strlen(finished),0);
+	cipher_wait();
+	return key;
+}
+
+/*******************************************************************************
+ * long long decrypt_chunked(int, long long)
+ *
+ * Handles a message of unknown length streamed in frames, each a 4 byte
+ * length in network byte order followed by that many bytes of the message
+ * and as many of the key. Each frame is sent back decrypted as soon as it
+ * arrives, and an empty frame ends the message
+ * Args: a socket file descriptor and the key length
+ * Returns: the length the message turned out to be, or -1 if the request
+ *          failed
+ ******************************************************************************/
+long long decrypt_chunked(int new_fd, long long key_length){
+	char frame[2 * CHUNK_SIZE];
+	uint32_t header;
+	long long total = 0;
+	ssize_t nwrote;
+	long long i;
+	streaming = 1;
+	while(1){
+		if(recv_all(new_fd, (char *)&header, sizeof(header)) == -1){
+			return -1;
+		}
+		long long n = ntohl(header);
+		if(n == 0){
+			break;
+		}
+		if(n > CHUNK_SIZE || total + n > key_length){
+			fprintf(stderr, "Invalid frame\n");
+			return -1;
+		}
+		if(recv_all(new_fd, frame, 2 * n) == -1){
+			return -1;
+		}
+		PROBE3(received, new_fd, OTP_OP, n);
+		run_cipher(frame, frame + n, n);
+		// begin sending the frame
+		for(i = 0; i < n; i += nwrote){
+			nwrote = write(new_fd, frame + i, n - i);
+			if(nwrote < 0){
+				fprintf(stderr, "Error in writing to socket\n");
+				return -1;
+			}
+			moved += nwrote;
+		}
+		PROBE3(reply, new_fd, OTP_OP, n);
+		total += n;
+	}
+	// echo finished response
+	char * finished = "opt_enc_d f";
+	send(new_fd, finished, strlen(finished),0);
+	return total;
+}
+
+/*******************************************************************************
+ * int decrypt_interleaved(int, long long)
+ *
+ * Handles a message sent in turns with its key: a chunk of CHUNK_SIZE bytes
+ * of the message, or what is left of it, then as much of the key. Each
+ * chunk is sent back decrypted as soon as both halves are in, so no more
+ * than a chunk is ever held, and only as much key as the message needs
+ * comes over at all
+ * Args: a socket file descriptor and the message length
+ * Returns: 0 on success, -1 if the request failed
+ ******************************************************************************/
+int decrypt_interleaved(int new_fd, long long message_length){
+	char frame[2 * CHUNK_SIZE];
+	ssize_t nwrote;
+	long long i = 0;
+	long long j;
+	long long n;
+	// whoever reads the client's output sets the pace as much as the client
+	streaming = 1;
+	for(; i < message_length; i += n){
+		n = message_length - i < CHUNK_SIZE ? message_length - i : CHUNK_SIZE;
+		if(recv_all(new_fd, frame, 2 * n) == -1){
+			return -1;
+		}
+		PROBE3(received, new_fd, OTP_OP, n);
+		run_cipher(frame, frame + n, n);
+		// begin sending the chunk
+		for(j = 0; j < n; j += nwrote){
+			nwrote = write(new_fd, frame + j, n - j);
+			if(nwrote < 0){
+				fprintf(stderr, "Error in writing to socket\n");
+				return -1;
+			}
+			moved += nwrote;
+		}
+		PROBE3(reply, new_fd, OTP_OP, n);
+	}
+	// echo finished response
+	char * finished = "opt_enc_d f";
+	send(new_fd, finished, strlen(finished),0);
+	return 0;
+}
+
+/*******************************************************************************
+ * int recv_fds(int, int *, int)
+ *
+ * Receives file descriptors a client passed over a unix domain socket
+ * Args: the socket, where to put them and how many are expected
+ * Returns: 1 if that many arrived, 0 if not
+ ******************************************************************************/
+int recv_fds(int new_fd, int * fds, int nfds){
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	char count;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &count;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if(recvmsg(new_fd, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+			(cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+			cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(nfds * sizeof(int))){
+		return 0;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+	return 1;
+}
+
+/*******************************************************************************
+ * void map_pads()
+ *
+ * Maps the pads registered with -P and -K. MAP_POPULATE reads every page
+ * in and fills in the page tables now, while nothing is waiting on it, so
+ * the cipher loop never stops for a major fault on a cold page. A pad
+ * registered with -K is also locked in memory, keeping its pages in the
+ * page cache for every process reading the file, not just this one. A pad
+ * that cannot be locked is still used, only unlocked
+ ******************************************************************************/
+void map_pads(){
+	struct stat st;
+	int i;
+	for(i = 0; i < npads; i++){
+		int fd = open(pads[i].path, O_RDONLY);
+		if(fd < 0 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+				st.st_size == 0){
+			fprintf(stderr, "Invalid pad %s\n", pads[i].path);
+			exit(1);
+		}
+		pads[i].dev = st.st_dev;
+		pads[i].ino = st.st_ino;
+		pads[i].size = st.st_size;
+		pads[i].data = mmap(NULL, pads[i].size, PROT_READ,
+				MAP_SHARED | MAP_POPULATE, fd, 0);
+		close(fd);
+		if(pads[i].data == MAP_FAILED){
+			fprintf(stderr, "Error mapping pad %s\n", pads[i].path);
+			exit(1);
+		}
+		madvise(pads[i].data, pads[i].size, MADV_SEQUENTIAL);
+		if(pads[i].locked && mlock(pads[i].data, pads[i].size) == -1){
+			fprintf(stderr, "Could not lock pad %s in memory\n", pads[i].path);
+			pads[i].locked = 0;
+		}
+	}
+}
+
+/*******************************************************************************
+ * void report_pads()
+ *
+ * Says how much of each registered pad is in memory, as mincore sees it.
+ * Done once the pads are mapped, and again on SIGUSR1
+ ******************************************************************************/
+void report_pads(){
+	unsigned char vec[RESIDENCY_BATCH];
+	long page = sysconf(_SC_PAGESIZE);
+	long long resident;
+	long long off;
+	long long n;
+	long long j;
+	int i;
+	for(i = 0; i < npads; i++){
+		resident = 0;
+		for(off = 0; off < pads[i].size; off += n * page){
+			n = (pads[i].size - off + page - 1) / page;
+			if(n > RESIDENCY_BATCH){
+				n = RESIDENCY_BATCH;
+			}
+			if(mincore(pads[i].data + off, n * page, vec) == -1){
+				break;
+			}
+			for(j = 0; j < n; j++){
+				resident += vec[j] & 1;
+			}
+		}
+		resident *= page;
+		printf("Pad %s: %lld of %lld bytes resident%s\n", pads[i].path,
+				resident < pads[i].size ? resident : pads[i].size,
+				pads[i].size, pads[i].locked ? ", locked" : "");
+	}
+	fflush(stdout);
+}
+
+/*******************************************************************************
+ * char * find_pad(struct stat *, long long)
+ *
+ * Looks for a registered pad that is the same file as a key
+ * Args: the key's status, and how much of it is needed
+ * Returns: the pad's mapping, or NULL if it is not registered or too short
+ ******************************************************************************/
+char * find_pad(struct stat * st, long long length){
+	int i;
+	for(i = 0; i < npads; i++){
+		if(pads[i].dev == st->st_dev && pads[i].ino == st->st_ino &&
+				pads[i].size >= length){
+			return pads[i].data;
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+ * int decrypt_files(int *, struct stat *, long long)
+ *
+ * Maps the message, key and output files of a request and decrypts the
+ * message straight into the output a segment at a time
+ * Args: the message, key and output file descriptors, the key's status and
+ *       the message length
+ * Returns: 0 on success, -1 if the files could not be mapped
+ ******************************************************************************/
+int decrypt_files(int * fds, struct stat * key_st, long long message_length){
+	char * message = mmap(NULL, message_length, PROT_READ, MAP_SHARED,
+			fds[0], 0);
+	// a registered pad is already mapped, and its pages already in
+	char * key = find_pad(key_st, message_length);
+	int registered = key != NULL;
+	if(!registered){
+		key = mmap(NULL, message_length, PROT_READ, MAP_SHARED, fds[1], 0);
+	}
+	char * out = mmap(NULL, message_length, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fds[2], 0);
+	if(message == MAP_FAILED || key == MAP_FAILED || out == MAP_FAILED){
+		fprintf(stderr, "Error mapping files\n");
+		if(message != MAP_FAILED){
+			munmap(message, message_length);
+		}
+		if(!registered && key != MAP_FAILED){
+			munmap(key, message_length);
+		}
+		if(out != MAP_FAILED){
+			munmap(out, message_length);
+		}
+		return -1;
+	}
+	madvise(message, message_length, MADV_SEQUENTIAL);
+	if(!registered){
+		madvise(key, message_length, MADV_SEQUENTIAL);
+	}
+	if(message_length >= PARALLEL_THRESHOLD){
+		cipher_pool_start();
+	}
+	// copy each segment in while the threads decrypt the one before
+	long long i = 0;
+	long long n;
+	for(; i < message_length; i += n){
+		n = message_length - i < SEGMENT_SIZE ? message_length - i : SEGMENT_SIZE;
+		memcpy(out + i, message + i, n);
+		cipher_submit(out + i, key + i, n);
+		// nothing goes through the socket, the work is the progress
+		moved += n;
+	}
+	cipher_wait();
+	munmap(message, message_length);
+	if(!registered){
+		munmap(key, message_length);
+	}
+	munmap(out, message_length);
+	return 0;
+}
+
+/*******************************************************************************
+ * int decrypt_mapped(int, long long)
+ *
+ * Handles a request from a client on the same host that passed its message,
+ * key and output files instead of sending them. They are mapped and the
+ * message is decrypted straight into the output a segment at a time, so no
+ * byte of it goes through the socket
+ * Args: a unix domain socket file descriptor and the message length
+ * Returns: 0 on success, -1 if the request failed
+ ******************************************************************************/
+int decrypt_mapped(int new_fd, long long message_length){
+	int fds[3];
+	struct stat message_st;
+	struct stat key_st;
+	int status = 0;
+	if(!recv_fds(new_fd, fds, 3)){
+		fprintf(stderr, "Error receiving files\n");
+		return -1;
+	}
+	// reading past the end of a mapping would kill us, check the sizes
+	if(fstat(fds[0], &message_st) == -1 || fstat(fds[1], &key_st) == -1 ||
+			message_st.st_size < message_length ||
+			key_st.st_size < message_length){
+		fprintf(stderr, "Invalid message or key file\n");
+		status = -1;
+	}
+	else if(ftruncate(fds[2], message_length) == -1){
+		fprintf(stderr, "Error sizing output file\n");
+		status = -1;
+	}
+	else if(message_length > 0){
+		status = decrypt_files(fds, &key_st, message_length);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	close(fds[2]);
+	if(status == -1){
+		return -1;
+	}
+	PROBE3(reply, new_fd, OTP_OP, message_length);
+	// echo finished response
+	char * finished = "opt_enc_d f";
+	send(new_fd, finished, strlen(finished),0);
+	return 0;
+}
+
+/*******************************************************************************
+ * int open_job_file(char *, char *, int)
+ *
+ * Opens one of the files that hold the state of a resumable job
+ * Args: the job id, the suffix of the file and the flags to open it with
+ * Returns: the file descriptor, or -1 if it could not be opened
+ ******************************************************************************/
+int open_job_file(char * job, char * suffix, int flags){
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s.%s", job_dir, job, suffix);
+	return open(path, flags | O_NOFOLLOW, 0600);
+}
+
+/*******************************************************************************
+ * int job_dir_safe()
+ *
+ * Makes the job directory if there is none, and makes sure nobody else can
+ * put files in it: it has to be a real directory of our own that only we
+ * can write to. Otherwise another user could plant job files or links
+ * Returns: 1 if it is safe to use, 0 if not
+ ******************************************************************************/
+int job_dir_safe(){
+	struct stat st;
+	mkdir(job_dir, 0700);
+	return lstat(job_dir, &st) == 0 && S_ISDIR(st.st_mode) &&
+		st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/*******************************************************************************
+ * pid_t parent_of(pid_t)
+ *
+ * Args: a process id
+ * Returns: the process's parent, or 0 if it is not there
+ ******************************************************************************/
+pid_t parent_of(pid_t pid){
+	char path[64];
+	char buffer[512];
+	int ppid = 0;
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return 0;
+	}
+	ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if(n <= 0){
+		return 0;
+	}
+	buffer[n] = '\0';
+	// the name in brackets can hold anything, the parent comes after it
+	char * end = strrchr(buffer, ')');
+	if(end == NULL || sscanf(end, ") %*c %d", &ppid) != 1){
+		return 0;
+	}
+	return ppid;
+}
+
+/*******************************************************************************
+ * pid_t job_holder(int)
+ *
+ * Finds the process of this daemon that holds the lock of a job. The kernel
+ * says who holds it in /proc/locks, and the holder has to descend from the
+ * daemon, a request child or a worker or a child a worker handed off to
+ * Args: the lock file descriptor
+ * Returns: the holder, or 0 if there is none this daemon can stop
+ ******************************************************************************/
+pid_t job_holder(int lock_fd){
+	struct stat st;
+	char line[256];
+	unsigned int major;
+	unsigned int minor;
+	unsigned long ino;
+	int pid;
+	pid_t holder = 0;
+	if(fstat(lock_fd, &st) == -1){
+		return 0;
+	}
+	FILE * locks = fopen("/proc/locks", "r");
+	if(locks == NULL){
+		return 0;
+	}
+	// waiting processes are listed with -> and do not match
+	while(fgets(line, sizeof(line), locks) != NULL){
+		if(sscanf(line, "%*d: FLOCK %*s %*s %d %x:%x:%lu", &pid, &major,
+				&minor, &ino) == 4 && major == major(st.st_dev) &&
+				minor == minor(st.st_dev) && ino == st.st_ino){
+			holder = pid;
+			break;
+		}
+	}
+	fclose(locks);
+	pid_t ancestor = holder;
+	int depth;
+	for(depth = 0; holder > 0 && holder != getpid() && depth < 3; depth++){
+		ancestor = parent_of(ancestor);
+		if(ancestor == daemon_pid){
+			return holder;
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+ * void job_owner(int, char *, size_t)
+ *
+ * Says who a connection is from as far as jobs go: the user on the other end
+ * of a unix domain socket, or the address of a client over TCP. A job belongs
+ * to whoever started it, and only they get to pick it up again
+ * Args: a socket file descriptor, where to put the owner and its size
+ ******************************************************************************/
+void job_owner(int new_fd, char * owner, size_t size){
+	struct sockaddr_storage addr;
+	socklen_t addr_size = sizeof(addr);
+	struct ucred cred;
+	socklen_t cred_size = sizeof(cred);
+	char host[INET_ADDRSTRLEN];
+	snprintf(owner, size, "unknown");
+	if(getpeername(new_fd, (struct sockaddr *)&addr, &addr_size) == -1){
+		return;
+	}
+	if(addr.ss_family == AF_UNIX &&
+			getsockopt(new_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) == 0){
+		snprintf(owner, size, "uid %u", (unsigned int)cred.uid);
+	}
+	else if(addr.ss_family == AF_INET &&
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, host,
+				sizeof(host)) != NULL){
+		snprintf(owner, size, "address %s", host);
+	}
+}
+
+/*******************************************************************************
+ * int job_owned_by(int, char *, int)
+ *
+ * Whether a job belongs to an owner, going by what its lock file says
+ * Args: the lock file descriptor, the owner, and what to say for a job that
+ *       has no owner written down yet
+ * Returns: 1 if it does, 0 if not
+ ******************************************************************************/
+int job_owned_by(int lock_fd, char * owner, int unowned){
+	char recorded[64];
+	ssize_t n = pread(lock_fd, recorded, sizeof(recorded) - 1, 0);
+	if(n <= 0){
+		return unowned;
+	}
+	recorded[n] = '\0';
+	return strcmp(recorded, owner) == 0;
+}
+
+/*******************************************************************************
+ * void remove_job(char *)
+ *
+ * Removes every file of a finished job
+ * Args: the job id
+ ******************************************************************************/
+void remove_job(char * job){
+	char path[4096];
+	char * suffixes[] = {"msg", "key", "tmp", "out", "lock"};
+	int i;
+	for(i = 0; i < 5; i++){
+		snprintf(path, sizeof(path), "%s/%s.%s", job_dir, job, suffixes[i]);
+		unlink(path);
+	}
+}
+
+/*******************************************************************************
+ * int lock_job(char *, char *)
+ *
+ * Takes a job for this process. The job belongs to the client that started
+ * it, whose owner is written in the lock file, and nobody else gets it. Its
+ * own client only reconnects once it has given up on its old connection, so
+ * whoever still holds the job for it is stuck on a dead connection and is
+ * told to stop. A lock file removed while we waited for it belongs to no job
+ * any more, so then the new one is locked instead
+ * Args: the job id and the owner of the connection asking for it
+ * Returns: the lock file descriptor, kept open while the job is held, -1 if
+ *          it could not be created, or -2 if the job belongs to someone else
+ ******************************************************************************/
+int lock_job(char * job, char * owner){
+	char path[4096];
+	struct stat held;
+	struct stat current;
+	snprintf(path, sizeof(path), "%s/%s.lock", job_dir, job);
+	while(1){
+		int lock_fd = open_job_file(job, "lock", O_RDWR | O_CREAT);
+		if(lock_fd == -1){
+			fprintf(stderr, "Error creating job %s\n", job);
+			return -1;
+		}
+		if(flock(lock_fd, LOCK_EX | LOCK_NB) == -1){
+			// a holder that has not written the owner yet has only just
+			// started the job, for a client that is not us
+			if(!job_owned_by(lock_fd, owner, 0)){
+				close(lock_fd);
+				return -2;
+			}
+			// a worker only acts on SIGTERM between requests
+			pid_t holder = job_holder(lock_fd);
+			if(holder > 0){
+				kill(holder, SIGKILL);
+			}
+			flock(lock_fd, LOCK_EX);
+		}
+		if(fstat(lock_fd, &held) == 0 && lstat(path, &current) == 0 &&
+				held.st_dev == current.st_dev && held.st_ino == current.st_ino){
+			// a job nobody is on still belongs to whoever started it
+			if(!job_owned_by(lock_fd, owner, 1)){
+				close(lock_fd);
+				return -2;
+			}
+			if(ftruncate(lock_fd, 0) == -1 ||
+					pwrite(lock_fd, owner, strlen(owner), 0) != (ssize_t)strlen(owner)){
+				fprintf(stderr, "Error creating job %s\n", job);
+				close(lock_fd);
+				return -1;
+			}
+			return lock_fd;
+		}
+		close(lock_fd);
+	}
+}
+
+/*******************************************************************************
+ * long long job_have(int, long long)
+ *
+ * How much of a file of a job has been received so far
+ * Args: the file descriptor and the full length of the file
+ ******************************************************************************/
+long long job_have(int fd, long long length){
+	struct stat st;
+	if(fstat(fd, &st) == -1){
+		return 0;
+	}
+	return st.st_size < length ? st.st_size : length;
+}
+
+/*******************************************************************************
+ * int decrypt_job(char *, int, int, long long)
+ *
+ * Decrypts the message of a job with its key into the output of the job.
+ * The output is only put in place once it is complete, so a job stopped
+ * part way through is decrypted again from the start
+ * Args: the job id, the message and key file descriptors and the length
+ * Returns: 0 on success, -1 if the job's files could not be used
+ ******************************************************************************/
+int decrypt_job(char * job, int msg_fd, int key_fd, long long message_length){
+	char message[CHUNK_SIZE];
+	char key[CHUNK_SIZE];
+	char tmp[4096];
+	char out[4096];
+	int tmp_fd = open_job_file(job, "tmp", O_RDWR | O_CREAT | O_TRUNC);
+	if(tmp_fd == -1){
+		fprintf(stderr, "Error creating job %s\n", job);
+		return -1;
+	}
+	long long i = 0;
+	long long n;
+	for(; i < message_length; i += n){
+		n = message_length - i < CHUNK_SIZE ? message_length - i : CHUNK_SIZE;
+		if(pread(msg_fd, message, n, i) != n || pread(key_fd, key, n, i) != n){
+			fprintf(stderr, "Error reading job %s\n", job);
+			close(tmp_fd);
+			return -1;
+		}
+		run_cipher(message, key, n);
+		if(pwrite(tmp_fd, message, n, i) != n){
+			fprintf(stderr, "Error writing job %s\n", job);
+			close(tmp_fd);
+			return -1;
+		}
+		moved += n;
+	}
+	close(tmp_fd);
+	snprintf(tmp, sizeof(tmp), "%s/%s.tmp", job_dir, job);
+	snprintf(out, sizeof(out), "%s/%s.out", job_dir, job);
+	rename(tmp, out);
+	return 0;
+}
+
+/*******************************************************************************
+ * int resume_job(int, char *, int, int, int *, long long, long long)
+ *
+ * Carries a job on from wherever it got to: receives the rest of the message
+ * and key, decrypts the message once both are in, and sends the rest of the
+ * result
+ * Args: a socket file descriptor, the job id, its message and key file
+ *       descriptors, its output file descriptor, -1 until there is one, and
+ *       the message and key lengths
+ * Returns: 0 on success, -1 if the request failed
+ ******************************************************************************/
+int resume_job(int new_fd, char * job, int msg_fd, int key_fd, int * out_fd,
+		long long message_length, long long key_length){
+	char buffer[64];
+	long long msg_have = job_have(msg_fd, message_length);
+	long long key_have = job_have(key_fd, key_length);
+	// tell the client how far it got last time
+	snprintf(buffer, sizeof(buffer), "%lld %lld", msg_have, key_have);
+	send(new_fd, buffer, strlen(buffer), 0);
+	// get the rest of the message and the key
+	if(recv_spool(new_fd, msg_fd, msg_have, message_length) == -1 ||
+			recv_spool(new_fd, key_fd, key_have, key_length) == -1){
+		return -1;
+	}
+	if(*out_fd == -1){
+		if(decrypt_job(job, msg_fd, key_fd, message_length) == -1){
+			return -1;
+		}
+		*out_fd = open_job_file(job, "out", O_RDONLY);
+		if(*out_fd == -1){
+			fprintf(stderr, "Error reading job %s\n", job);
+			return -1;
+		}
+	}
+	// find out how much of the result the client already has
+	memset(buffer, 0, sizeof(buffer));
+	if(recv(new_fd, buffer, sizeof(buffer) - 1, 0) <= 0){
+		return -1;
+	}
+	long long out_have = strtoll(buffer, NULL, 10);
+	if(out_have < 0 || out_have > message_length){
+		fprintf(stderr, "Invalid result offset\n");
+		return -1;
+	}
+	// send back the rest of the file
+	int sent = send_spool(new_fd, *out_fd, out_have, message_length);
+	if(sent == 1){
+		remove_job(job);
+	}
+	return sent == -1 ? -1 : 0;
+}
+
+/*******************************************************************************
+ * int handle_job(int, char *, long long, long long)
+ *
+ * Handles a resumable request. Everything received is kept in the job
+ * directory, so when the connection drops the client can reconnect with the
+ * same job id and carry on from where it got to. Instead of echoing the key
+ * length the daemon answers with how much of the message and key it already
+ * has, or with Busy when the job is another client's; the client sends the
+ * rest of each, then tells the daemon how much of the result it already has
+ * and gets the rest of that. The job is removed once the client confirms it
+ * has the whole result, or by the daemon after the grace period
+ * Args: a socket file descriptor, the job id, the message and key lengths
+ * Returns: 0 on success, -1 if the request failed
+ ******************************************************************************/
+int handle_job(int new_fd, char * job, long long message_length,
+		long long key_length){
+	char owner[64];
+	int status = -1;
+	if(!job_dir_safe()){
+		fprintf(stderr, "Unsafe job directory %s\n", job_dir);
+		return -1;
+	}
+	job_owner(new_fd, owner, sizeof(owner));
+	int lock_fd = lock_job(job, owner);
+	if(lock_fd == -2){
+		fprintf(stderr, "Job %s belongs to another client\n", job);
+		char busy[] = "Busy";
+		send(new_fd, busy, strlen(busy), 0);
+		return -1;
+	}
+	if(lock_fd == -1){
+		return -1;
+	}
+	int msg_fd = open_job_file(job, "msg", O_RDWR | O_CREAT);
+	int key_fd = open_job_file(job, "key", O_RDWR | O_CREAT);
+	int out_fd = open_job_file(job, "out", O_RDONLY);
+	if(msg_fd == -1 || key_fd == -1){
+		fprintf(stderr, "Error creating job %s\n", job);
+	}
+	else{
+		status = resume_job(new_fd, job, msg_fd, key_fd, &out_fd,
+				message_length, key_length);
+	}
+	if(msg_fd != -1){
+		close(msg_fd);
+	}
+	if(key_fd != -1){
+		close(key_fd);
+	}
+	if(out_fd != -1){
+		close(out_fd);
+	}
+	close(lock_fd);
+	return status;
+}
+
+/*******************************************************************************
+ * void sweep_jobs()
+ *
+ * Removes the files of resumable jobs nobody has touched for the grace
+ * period, whose clients have given up on them. A job is swept as a whole,
+ * under its lock, and one whose lock is held is still being worked on no
+ * matter how long it has been going. Files left without a lock are swept
+ * on their own
+ ******************************************************************************/
+void sweep_jobs(){
+	static char * const suffixes[] = {"msg", "key", "tmp", "out", "lock"};
+	char path[4096];
+	char job[JOB_ID_SIZE + 1];
+	struct stat st;
+	struct dirent * entry;
+	DIR * dir = opendir(job_dir);
+	if(dir == NULL){
+		return;
+	}
+	time_t now = time(NULL);
+	int i;
+	while((entry = readdir(dir)) != NULL){
+		char * dot = strrchr(entry->d_name, '.');
+		if(entry->d_name[0] == '.' || dot == NULL ||
+				dot - entry->d_name > JOB_ID_SIZE){
+			continue;
+		}
+		snprintf(job, dot - entry->d_name + 1, "%s", entry->d_name);
+		int lock_fd = open_job_file(job, "lock", O_RDWR);
+		if(lock_fd == -1){
+			// nobody can be working on it without the lock
+			snprintf(path, sizeof(path), "%s/%s", job_dir, entry->d_name);
+			if(lstat(path, &st) == 0 && now - st.st_mtime > job_grace){
+				unlink(path);
+			}
+			continue;
+		}
+		if(strcmp(dot, ".lock") != 0 || flock(lock_fd, LOCK_EX | LOCK_NB) == -1){
+			// each job is looked at once, through its lock file
+			close(lock_fd);
+			continue;
+		}
+		// the job is idle since the last time any of its files changed
+		time_t newest = 0;
+		for(i = 0; i < 5; i++){
+			snprintf(path, sizeof(path), "%s/%s.%s", job_dir, job, suffixes[i]);
+			if(lstat(path, &st) == 0 && st.st_mtime > newest){
+				newest = st.st_mtime;
+			}
+		}
+		if(now - newest > job_grace){
+			remove_job(job);
+		}
+		close(lock_fd);
+	}
+	closedir(dir);
+}
+
+/*******************************************************************************
+ * void sched_init()
+ *
+ * Sets up the queue for large jobs in memory shared with every process the
+ * daemon forks
+ ******************************************************************************/
+void sched_init(){
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	sched = mmap(NULL, sizeof(struct scheduler), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(sched == MAP_FAILED){
+		fprintf(stderr, "Error creating job queue\n");
+		exit(1);
+	}
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	// a process killed while holding the lock must not wedge the rest
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&sched->lock, &mattr);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&sched->turn, &cattr);
+}
+
+/*******************************************************************************
+ * void sched_lock()
+ *
+ * Locks the queue, taking over the lock from a process that died with it
+ ******************************************************************************/
+void sched_lock(){
+	if(pthread_mutex_lock(&sched->lock) == EOWNERDEAD){
+		pthread_mutex_consistent(&sched->lock);
+	}
+}
+
+/*******************************************************************************
+ * void sched_prune()
+ *
+ * Forgets the jobs whose processes are gone without leaving the queue,
+ * like those that lost their client. Called with the queue locked
+ ******************************************************************************/
+void sched_prune(){
+	int i;
+	for(i = 0; i < sched->nrunning; i++){
+		if(kill(sched->running[i], 0) == -1 && errno == ESRCH){
+			sched->running[i--] = sched->running[--sched->nrunning];
+		}
+	}
+	for(i = 0; i < sched->nwaiting; i++){
+		if(kill(sched->waiting[i].pid, 0) == -1 && errno == ESRCH){
+			sched->waiting[i--] = sched->waiting[--sched->nwaiting];
+		}
+	}
+}
+
+/*******************************************************************************
+ * pid_t sched_next()
+ *
+ * Picks the waiting job to run next: the one that has waited longest if it
+ * is past the age limit, otherwise the smallest. Called with the queue locked
+ * Returns: the pid of the process with the job
+ ******************************************************************************/
+pid_t sched_next(){
+	int i;
+	int oldest = 0;
+	int smallest = 0;
+	for(i = 1; i < sched->nwaiting; i++){
+		if(sched->waiting[i].since < sched->waiting[oldest].since){
+			oldest = i;
+		}
+		if(sched->waiting[i].size < sched->waiting[smallest].size){
+			smallest = i;
+		}
+	}
+	if(time(NULL) - sched->waiting[oldest].since >= age_limit){
+		return sched->waiting[oldest].pid;
+	}
+	return sched->waiting[smallest].pid;
+}
+
+/*******************************************************************************
+ * void sched_leave()
+ *
+ * Gives up this process's slot, if it has one, and wakes up the jobs waiting
+ * for one. Runs when the process exits
+ ******************************************************************************/
+void sched_leave(){
+	int i;
+	if(!sched_entered){
+		return;
+	}
+	sched_entered = 0;
+	sched_lock();
+	for(i = 0; i < sched->nrunning; i++){
+		if(sched->running[i] == getpid()){
+			sched->running[i] = sched->running[--sched->nrunning];
+			break;
+		}
+	}
+	pthread_cond_broadcast(&sched->turn);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/*******************************************************************************
+ * void sched_enter(long long)
+ *
+ * Waits for this large job's turn to run. The wait wakes up every second
+ * as well, so jobs that died and jobs past the age limit are noticed
+ * Args: the message length
+ ******************************************************************************/
+void sched_enter(long long message_length){
+	struct timespec until;
+	int i;
+	set_phase(PHASE_QUEUED);
+	sched_lock();
+	while(sched->nwaiting == SCHED_QUEUE){
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		pthread_cond_timedwait(&sched->turn, &sched->lock, &until);
+		sched_prune();
+	}
+	sched->waiting[sched->nwaiting].pid = getpid();
+	sched->waiting[sched->nwaiting].size = message_length;
+	sched->waiting[sched->nwaiting++].since = time(NULL);
+	while(1){
+		sched_prune();
+		if(sched->nrunning < large_slots && sched_next() == getpid()){
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		pthread_cond_timedwait(&sched->turn, &sched->lock, &until);
+	}
+	for(i = 0; i < sched->nwaiting; i++){
+		if(sched->waiting[i].pid == getpid()){
+			sched->waiting[i] = sched->waiting[--sched->nwaiting];
+			break;
+		}
+	}
+	sched->running[sched->nrunning++] = getpid();
+	// the next in line may be able to go too
+	pthread_cond_broadcast(&sched->turn);
+	pthread_mutex_unlock(&sched->lock);
+	if(!sched_registered){
+		atexit(sched_leave);
+		sched_registered = 1;
+	}
+	sched_entered = 1;
+}
+
+/*******************************************************************************
+ * int parse_cpulist(char *, cpu_set_t *)
+ *
+ * Reads a list of CPUs like 0-3,8,10-11, the format of -a and of the node
+ * lists under /sys
+ * Args: the list and the set to fill in
+ * Returns: 1 if the list made sense, 0 if not
+ ******************************************************************************/
+int parse_cpulist(char * list, cpu_set_t * set){
+	char * end;
+	long first;
+	long last;
+	CPU_ZERO(set);
+	while(*list != '\0' && *list != '\n'){
+		first = strtol(list, &end, 10);
+		if(end == list){
+			return 0;
+		}
+		last = first;
+		if(*end == '-'){
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if(end == list){
+				return 0;
+			}
+		}
+		if(first < 0 || last < first || last >= CPU_SETSIZE){
+			return 0;
+		}
+		for(; first <= last; first++){
+			CPU_SET(first, set);
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+/*******************************************************************************
+ * void numa_init()
+ *
+ * Finds out which CPUs are on which NUMA node. A machine without the node
+ * lists counts as one node with every CPU
+ ******************************************************************************/
+void numa_init(){
+	char path[64];
+	char list[4096];
+	for(nnodes = 0; nnodes < MAX_NODES; nnodes++){
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+				nnodes);
+		int fd = open(path, O_RDONLY);
+		if(fd == -1){
+			break;
+		}
+		ssize_t n = read(fd, list, sizeof(list) - 1);
+		close(fd);
+		list[n > 0 ? n : 0] = '\0';
+		if(!parse_cpulist(list, &node_cpus[nnodes])){
+			// a node with memory but no CPUs of its own
+			CPU_ZERO(&node_cpus[nnodes]);
+		}
+	}
+	if(nnodes == 0){
+		node_cpus[0] = allowed_cpus;
+		nnodes = 1;
+	}
+}
+
+/*******************************************************************************
+ * int connection_node(int)
+ *
+ * Finds the NUMA node a connection's packets are being handled on, which is
+ * the node of the network card receiving them when interrupts are spread
+ * the usual way
+ * Args: a socket file descriptor
+ * Returns: the node, or -1 if it cannot be told
+ ******************************************************************************/
+int connection_node(int new_fd){
+	int cpu;
+	int node;
+	socklen_t size = sizeof(cpu);
+	if(getsockopt(new_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size) == -1 ||
+			cpu < 0 || cpu >= CPU_SETSIZE){
+		return -1;
+	}
+	for(node = 0; node < nnodes; node++){
+		if(CPU_ISSET(cpu, &node_cpus[node])){
+			return node;
+		}
+	}
+	return -1;
+}
+
+/*******************************************************************************
+ * void bind_to_node(int)
+ *
+ * Keeps this process, and the cipher threads it starts from now on, on the
+ * CPUs of a node the daemon is allowed, and has the memory it touches from
+ * now on allocated on that node too, falling back to the others when it is
+ * full. Leaves things be when the node is not known or has none of the
+ * allowed CPUs
+ * Args: the node
+ ******************************************************************************/
+void bind_to_node(int node){
+	cpu_set_t set;
+	unsigned long nodes[(MAX_NODES + 8 * sizeof(unsigned long) - 1) /
+		(8 * sizeof(unsigned long))];
+	if(node < 0 || node >= nnodes){
+		return;
+	}
+	CPU_AND(&set, &node_cpus[node], &allowed_cpus);
+	if(CPU_COUNT(&set) == 0){
+		return;
+	}
+	if(sched_setaffinity(0, sizeof(set), &set) == -1){
+		fprintf(stderr, "Error binding to node %d\n", node);
+		return;
+	}
+	memset(nodes, 0, sizeof(nodes));
+	nodes[node / (8 * sizeof(unsigned long))] |=
+		1UL << node % (8 * sizeof(unsigned long));
+	// the kernel counts one past the last node, and without NUMA support
+	// it refuses, the CPUs are what matter most
+	syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, 8 * sizeof(nodes) + 1);
+}
+
+/*******************************************************************************
+ * int hand_off_large(int)
+ *
+ * Hands the large job of a worker to a child of its own, so the worker can
+ * get back to accepting small ones. The child dies with the worker, and
+ * with NUMA placement moves to the node the connection came in on
+ * Args: the socket file descriptor of the job
+ * Returns: 1 in the worker, which is done with the request, 0 in the child
+ *          or if there could be no child
+ ******************************************************************************/
+int hand_off_large(int new_fd){
+	int i;
+	pid_t pid = fork();
+	if(pid == -1){
+		fprintf(stderr, "Error in fork\n");
+		return 0;
+	}
+	if(pid > 0){
+		return 1;
+	}
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	large_child = 1;
+	for(i = 0; i < worker_nlisteners; i++){
+		close(worker_listeners[i]);
+	}
+	// threads do not survive a fork, the child starts its own
+	memset(&pool, 0, sizeof(pool));
+	watchdog_arm();
+	if(numa_placement){
+		// the worker's buffers are on the worker's node, start afresh on
+		// the connection's
+		for(i = 0; i < ARENA_SLOTS; i++){
+			if(arena.buffers[i].data != NULL){
+				munmap(arena.buffers[i].data, arena.buffers[i].size);
+			}
+		}
+		memset(&arena, 0, sizeof(arena));
+		bind_to_node(connection_node(new_fd));
+	}
+	return 0;
+}
+
+/*******************************************************************************
+ * long long decrypt_buffered(int, long long, long long)
+ *
+ * Receives a message and key that fit in memory into buffers from the arena,
+ * decrypts the message and sends it back
+ * Args: a socket file descriptor, the message and key lengths
+ * Returns: the message length, or -1 if the request failed
+ ******************************************************************************/
+long long decrypt_buffered(int new_fd, long long message_length,
+		long long key_length){
+	// get the message
+	char * message = recv_file(new_fd, message_length, message_length);
+	char * key;
+	if(message == NULL){
+		return -1;
+	}
+	if(cipher_threads > 1 && message_length >= PARALLEL_THRESHOLD){
+		// split the work between threads as the key arrives
+		cipher_pool_start();
+		key = recv_key_and_decrypt(new_fd, message, message_length, key_length);
+	}
+	else{
+		// get as much of the key as the message needs
+		key = recv_file(new_fd, key_length, message_length);
+		if(key != NULL){
+			run_cipher(message, key, message_length);
+		}
+	}
+	// send back the file
+	if(key == NULL || send_file(new_fd, message, message_length) == -1){
+		return -1;
+	}
+	// give the key and message buffers back for the next request
+	arena_put(message);
+	arena_put(key);
+	return message_length;
+}
+
+/*******************************************************************************
+ * long long decrypt_request(int, struct request *, long long, long long)
+ *
+ * Receives the message and key of a request the way the client asked to
+ * send them, decrypts the message and sends it back
+ * Args: a socket file descriptor, the request, the message and key lengths
+ * Returns: the message length, which a streamed message only has by now, or
+ *          -1 if the request failed
+ ******************************************************************************/
+long long decrypt_request(int new_fd, struct request * req,
+		long long message_length, long long key_length){
+	int status;
+	if(req->chunked){
+		return decrypt_chunked(new_fd, key_length);
+	}
+	if(req->interleaved){
+		status = decrypt_interleaved(new_fd, message_length);
+	}
+	else if(req->fds){
+		// the files are mapped, not received
+		status = decrypt_mapped(new_fd, message_length);
+	}
+	else if(message_length > SPOOL_THRESHOLD){
+		// too large for memory, go through a spool file
+		status = decrypt_spooled(new_fd, message_length, key_length);
+	}
+	else{
+		return decrypt_buffered(new_fd, message_length, key_length);
+	}
+	return status == -1 ? -1 : message_length;
+}
+
+/*******************************************************************************
+ * void trace_request(int, struct request *, struct timespec *, long long,
+ *                    long long)
+ *
+ * Appends a record of a finished request to the trace, if there is one. The
+ * record goes out in a single write to a file opened for appending, so the
+ * records of processes finishing at the same time do not interleave
+ * Args: a socket file descriptor, the request, when it came in and the
+ *       message and key lengths
+ ******************************************************************************/
+void trace_request(int new_fd, struct request * req, struct timespec * arrival,
+		long long message_length, long long key_length){
+	struct trace_record record;
+	struct timespec now;
+	struct sockaddr_storage addr;
+	socklen_t addr_size = sizeof(addr);
+	struct ucred cred;
+	socklen_t cred_size = sizeof(cred);
+	if(trace_fd == -1){
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&record, 0, sizeof(record));
+	record.arrival = arrival->tv_sec * 1000000000ULL + arrival->tv_nsec;
+	record.duration = now.tv_sec * 1000000000ULL + now.tv_nsec - record.arrival;
+	record.message_length = message_length;
+	record.key_length = key_length;
+	record.op = OTP_OP;
+	record.version = TRACE_VERSION;
+	record.flags = (req->binary ? TRACE_XOR : 0) |
+		(req->job[0] != '\0' ? TRACE_JOB : 0) | (req->fds ? TRACE_FDS : 0) |
+		(req->chunked ? TRACE_CHUNKED : 0) |
+		(req->interleaved ? TRACE_INTERLEAVED : 0);
+	if(!req->binary){
+		strncpy(record.alphabet, req->alphabet->name, sizeof(record.alphabet) - 1);
+	}
+	if(getpeername(new_fd, (struct sockaddr *)&addr, &addr_size) == 0){
+		if(addr.ss_family == AF_INET){
+			record.client = ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+		}
+		else if(addr.ss_family == AF_UNIX){
+			record.flags |= TRACE_UNIX;
+			if(getsockopt(new_fd, SOL_SOCKET, SO_PEERCRED, &cred,
+						&cred_size) == 0){
+				record.client = cred.uid;
+			}
+		}
+	}
+	if(write(trace_fd, &record, sizeof(record)) != sizeof(record)){
+		fprintf(stderr, "Error writing trace\n");
+	}
+}
+
+/*******************************************************************************
+ * int request_failed()
+ *
+ * Gives up on the request being handled. A process forked for it just exits.
+ * A worker cleans up after it instead and goes on to the next request with
+ * the same arena and cipher threads: the threads finish whatever batch they
+ * were given, and every buffer the request had goes back to the arena
+ * Returns: -1, for handle_request to return
+ ******************************************************************************/
+int request_failed(){
+	int i;
+	if(workers == 0 || large_child){
+		_Exit(2);
+	}
+	watchdog_stop();
+	cipher_wait();
+	for(i = 0; i < ARENA_SLOTS; i++){
+		if(arena.buffers[i].data != NULL && arena.buffers[i].in_use){
+			arena_put(arena.buffers[i].data);
+		}
+	}
+	request_fd = -1;
+	return -1;
+}
+
+/*******************************************************************************
+ * int handle_request(int)
+ * 
+ * Handles the request from the client
+ * Args: the newly created socket from the request
+ * Returns: 0 once the request is done, -1 if it failed, which only a worker
+ *          gets to see
+ ******************************************************************************/
+int handle_request(int new_fd){
+	struct request req;
+	// when the request came in, for the trace
+	struct timespec arrival;
+	clock_gettime(CLOCK_REALTIME, &arrival);
+	request_fd = new_fd;
+	watchdog_start();
+	int correct_client = handshake(new_fd, &req);
+	PROBE3(handshake, new_fd, OTP_OP, correct_client);
+	if (!correct_client){
+		fprintf(stderr, "Invalid Client\n");
+		char invalid[] = "Invalid";
+		send(new_fd, invalid, strlen(invalid),0);
+		return request_failed();
+	}
+	char valid[] = "Valid";
+	send(new_fd, valid, strlen(valid), 0);
+	cipher = req.binary ? xor_message : req.alphabet->decrypt;
+	if(numa_placement && workers == 0){
+		// a child of its own, it can move to where the connection came in
+		bind_to_node(connection_node(new_fd));
+	}
+	// get the length of how long the file is
+	char buffer[24];
+	memset(buffer, 0, sizeof(buffer));
+	if(recv(new_fd, buffer, sizeof(buffer) - 1, 0) <= 0){
+		return request_failed();
+	}
+	long long message_length = strtoll(buffer, NULL, 10);
+	// send the length of the file back
+	send(new_fd, buffer, strlen(buffer),0);
+	// get the length of the key
+	memset(buffer, 0, sizeof(buffer));
+	if(recv(new_fd, buffer, sizeof(buffer) - 1, 0) <= 0){
+		return request_failed();
+	}
+	long long key_length = strtoll(buffer, NULL, 10);
+	PROBE4(header, new_fd, OTP_OP, message_length, key_length);
+	// a streamed message has no length up front and is sent as -1
+	if(req.chunked ? message_length != -1 || key_length < 0 :
+			message_length < 0 || key_length < message_length){
+		fprintf(stderr, "Invalid message or key length\n");
+		return request_failed();
+	}
+	if(req.job[0] != '\0'){
+		// resumable, the job answers the key length itself
+		set_phase(PHASE_RECEIVE);
+		if(handle_job(new_fd, req.job, message_length, key_length) == -1){
+			return request_failed();
+		}
+	}
+	else{
+		if(message_length >= large_threshold){
+			// large jobs wait their turn, and never in a worker small jobs need
+			if(workers > 0 && !large_child && hand_off_large(new_fd)){
+				watchdog_stop();
+				request_fd = -1;
+				return 0;
+			}
+			sched_enter(message_length);
+		}
+		set_phase(PHASE_RECEIVE);
+		// send the length of the key back
+		send(new_fd, buffer, strlen(buffer),0);
+		message_length = decrypt_request(new_fd, &req, message_length, key_length);
+		if(message_length == -1){
+			return request_failed();
+		}
+	}
+	watchdog_stop();
+	request_fd = -1;
+	trace_request(new_fd, &req, &arrival, message_length, key_length);
+	return 0;
+}
+
+
+/*******************************************************************************
+ * void on_signal(int)
+ *
+ * Passes SIGCHLD, SIGTERM and SIGUSR1 on to the accept loop through the
+ * signal pipe, so they wake it up from poll instead of being missed between
+ * checks
+ * Args: the signal number
+ ******************************************************************************/
+void on_signal(int signo){
+	char c = signo == SIGCHLD ? 'C' : signo == SIGUSR1 ? 'U' : 'T';
+	int saved = errno;
+	if(write(signal_pipe[1], &c, 1) == -1){
+		// the pipe is full, the loop already has something to wake up for
+	}
+	errno = saved;
+}
+
+/*******************************************************************************
+ * void reap_children()
+ *
+ * Collects every child that has exited and forgets about it
+ ******************************************************************************/
+void reap_children(){
+	int status;
+	pid_t pid;
+	int i;
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+		for(i = 0; i < nchildren; i++){
+			if(children[i] == pid){
+				children[i] = children[--nchildren];
+				break;
+			}
+		}
+	}
+}
+
+/*******************************************************************************
+ * void add_child(pid_t)
+ *
+ * Remembers a child handling a request, so it can be waited for on shutdown
+ * Args: the child's pid
+ ******************************************************************************/
+void add_child(pid_t pid){
+	if(nchildren == children_size){
+		children_size = children_size == 0 ? 64 : children_size * 2;
+		children = realloc(children, children_size * sizeof(pid_t));
+		if(children == NULL){
+			fprintf(stderr, "Error allocating child list\n");
+			exit(1);
+		}
+	}
+	children[nchildren++] = pid;
+}
+
+/*******************************************************************************
+ * void on_worker_signal(int)
+ *
+ * Tells a worker to exit once it is done with the request it is on
+ * Args: the signal number
+ ******************************************************************************/
+void on_worker_signal(int signo){
+	worker_stop = 1;
+}
+
+/*******************************************************************************
+ * void run_worker(int *, int)
+ *
+ * The loop of a long-lived worker. It accepts and handles requests itself,
+ * one at a time, so its buffers and cipher threads are reused from one
+ * request to the next. A request that fails is given up on, not the worker.
+ * SIGTERM is only let through while waiting, which lets the request in hand
+ * finish before the worker exits
+ * Args: the listening sockets and how many there are
+ ******************************************************************************/
+void run_worker(int * listeners, int nlisteners){
+	struct pollfd fds[2];
+	struct sigaction sa;
+	sigset_t block;
+	sigset_t waiting;
+	int i;
+	worker_listeners = listeners;
+	worker_nlisteners = nlisteners;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_worker_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	// children with large jobs are not waited for one at a time
+	signal(SIGCHLD, SIG_IGN);
+	// a client that went away is an error the request returns, not a
+	// signal that takes the worker with it
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&block);
+	sigaddset(&block, SIGTERM);
+	sigprocmask(SIG_BLOCK, &block, &waiting);
+	sigdelset(&waiting, SIGTERM);
+	for(i = 0; i < nlisteners; i++){
+		fds[i].fd = listeners[i];
+		fds[i].events = POLLIN;
+	}
+	while(!worker_stop){
+		if(ppoll(fds, nlisteners, NULL, &waiting) <= 0){
+			continue;
+		}
+		for(i = 0; i < nlisteners; i++){
+			if(!(fds[i].revents & POLLIN)){
+				continue;
+			}
+			// another worker may have got there first
+			int new_fd = accept(fds[i].fd, NULL, NULL);
+			if(new_fd == -1){
+				continue;
+			}
+			PROBE1(accept, new_fd);
+			// whether it worked or not, the worker is ready for the next
+			handle_request(new_fd);
+			close(new_fd);
+			if(large_child){
+				exit(0);
+			}
+			// in case the large job could not be handed off
+			sched_leave();
+		}
+	}
+	// let the large jobs handed off finish too
+	while(wait(NULL) > 0){
+	}
+	exit(0);
+}
+
+/*******************************************************************************
+ * void spawn_workers(int *, int, int)
+ *
+ * Forks workers until there are as many as the daemon was asked to run
+ * Args: the listening sockets, how many there are and the control socket
+ ******************************************************************************/
+void spawn_workers(int * listeners, int nlisteners, int ctl_fd){
+	while(nchildren < workers){
+		// spread the workers across the nodes
+		int node = nplaced++ % (nnodes > 0 ? nnodes : 1);
+		pid_t pid = fork();
+		if(pid == -1){
+			fprintf(stderr, "Error in fork\n");
+			return;
+		}
+		if(pid == 0){
+			if(numa_placement){
+				bind_to_node(node);
+			}
+			if(ctl_fd != -1){
+				close(ctl_fd);
+			}
+			close(signal_pipe[0]);
+			close(signal_pipe[1]);
+			signal(SIGCHLD, SIG_DFL);
+			// only the parent reports on the pads, and the signal pipe is
+			// gone, its number may now be a connection's
+			signal(SIGUSR1, SIG_IGN);
+			run_worker(listeners, nlisteners);
+		}
+		add_child(pid);
+	}
+}
+
+/*******************************************************************************
+ * int peer_is_us(int)
+ *
+ * Whether the process at the other end of a unix domain socket runs as the
+ * same user as us. Only it may take or hand over the listening sockets
+ * Args: a connected unix domain socket
+ * Returns: 1 if it does, 0 if not or if it cannot be told
+ ******************************************************************************/
+int peer_is_us(int sockfd){
+	struct ucred cred;
+	socklen_t cred_size = sizeof(cred);
+	return getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) == 0 &&
+		cred.uid == geteuid();
+}
+
+/*******************************************************************************
+ * int take_over(char *, int *)
+ *
+ * Asks a daemon already running on the control socket for its listening
+ * sockets. It hands them over and starts draining, so connections keep
+ * being accepted the whole time
+ * Args: the control socket path and where to put the listening sockets
+ * Returns: how many listening sockets were taken over, 0 if there was no
+ *          daemon to take over from
+ ******************************************************************************/
+int take_over(char * path, int * listeners){
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	char count;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	int sockfd;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+		return 0;
+	}
+	if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+		// nobody there, start from scratch
+		close(sockfd);
+		return 0;
+	}
+	if(!peer_is_us(sockfd)){
+		fprintf(stderr, "The daemon on %s belongs to another user\n", path);
+		exit(1);
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &count;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if(recvmsg(sockfd, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+			cmsg->cmsg_type != SCM_RIGHTS || count < 1 || count > 2){
+		fprintf(stderr, "Error taking over from the running daemon\n");
+		exit(1);
+	}
+	memcpy(listeners, CMSG_DATA(cmsg), count * sizeof(int));
+	close(sockfd);
+	return count;
+}
+
+/*******************************************************************************
+ * int hand_over(int, int *, int)
+ *
+ * Sends the listening sockets to a new daemon that connected to the control
+ * socket, as long as it runs as the same user
+ * Args: the control socket, the listening sockets and how many there are
+ * Returns: 1 if they were handed over, 0 if not
+ ******************************************************************************/
+int hand_over(int ctl_fd, int * listeners, int nlisteners){
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	char count = nlisteners;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	int new_fd = accept(ctl_fd, NULL, NULL);
+	if(new_fd == -1){
+		return 0;
+	}
+	if(!peer_is_us(new_fd)){
+		fprintf(stderr, "Refused to hand over to another user\n");
+		close(new_fd);
+		return 0;
+	}
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &count;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nlisteners * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nlisteners * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), listeners, nlisteners * sizeof(int));
+	if(sendmsg(new_fd, &msg, 0) != 1){
+		fprintf(stderr, "Error handing over listening sockets\n");
+		close(new_fd);
+		return 0;
+	}
+	close(new_fd);
+	return 1;
+}
+
+/*******************************************************************************
+ * void drain()
+ *
+ * Waits for the requests still in flight to finish, for up to the drain
+ * deadline, then stops whatever is left and exits. Called once the daemon
+ * has stopped accepting, or with workers, once it has stopped respawning them
+ ******************************************************************************/
+void drain(){
+	char c;
+	int i;
+	time_t deadline = time(NULL) + drain_seconds;
+	printf("Draining %d %s, %lu stalled connections were reaped\n", nchildren,
+			workers > 0 ? "workers" : "requests", *stalled);
+	fflush(stdout);
+	// workers finish the request they are on, then exit
+	for(i = 0; i < nchildren && workers > 0; i++){
+		kill(children[i], SIGTERM);
+	}
+	while(nchildren > 0 && time(NULL) < deadline){
+		struct pollfd fd = {signal_pipe[0], POLLIN, 0};
+		if(poll(&fd, 1, (deadline - time(NULL)) * 1000) > 0){
+			while(read(signal_pipe[0], &c, 1) == 1){
+			}
+		}
+		reap_children();
+	}
+	for(i = 0; i < nchildren; i++){
+		kill(children[i], workers > 0 ? SIGKILL : SIGTERM);
+	}
+	exit(0);
+}
+
+/*******************************************************************************
+ * void wait_for_connection(int *, int, int)
+ * 
+ * waits for a new connection to the server on any of the listening sockets.
+ * A connection on the control socket is a new daemon taking over, and
+ * SIGTERM is a shutdown; either way the daemon stops accepting and drains
+ * Args: the file descriptors to wait on, how many there are and the
+ *       control socket, or -1 if there is none
+ ******************************************************************************/
+void wait_for_connection(int * listeners, int nlisteners, int ctl_fd){
+	// create a container for the connection
+	struct sockaddr_storage their_addr;
+	// create a size for the connection
+    socklen_t addr_size;
+	// create a new file descriptor for the connection
+	int new_fd;
+	// pid variable;
+	pid_t pid;
+	// poll set for the listening sockets, the signal pipe and control socket
+	struct pollfd fds[4];
+	int nfds = nlisteners;
+	int i;
+	char c;
+	// when resumable jobs were last swept
+	time_t swept = time(NULL);
+	for(i = 0; i < nlisteners; i++){
+		fds[i].fd = listeners[i];
+		// the workers accept, not us
+		fds[i].events = workers > 0 ? 0 : POLLIN;
+	}
+	fds[nfds].fd = signal_pipe[0];
+	fds[nfds++].events = POLLIN;
+	if(ctl_fd != -1){
+		fds[nfds].fd = ctl_fd;
+		fds[nfds++].events = POLLIN;
+	}
+	// children should not inherit what is still in the buffer
+	fflush(stdout);
+	spawn_workers(listeners, nlisteners, ctl_fd);
+	// run forever
+	while(1){
+		// clear out abandoned jobs every so often
+		if(time(NULL) - swept >= SWEEP_INTERVAL){
+			sweep_jobs();
+			swept = time(NULL);
+		}
+		// wait for a client on any listener
+		if(poll(fds, nfds, SWEEP_INTERVAL * 1000) <= 0){
+			continue;
+		}
+		if(fds[nlisteners].revents & POLLIN){
+			// children exited, we were told to stop, or asked about the pads
+			int stop = 0;
+			int report = 0;
+			while(read(signal_pipe[0], &c, 1) == 1){
+				stop |= c == 'T';
+				report |= c == 'U';
+			}
+			reap_children();
+			if(report){
+				report_pads();
+			}
+			if(stop){
+				printf("Shutting down\n");
+				drain();
+			}
+			// replace workers that died
+			spawn_workers(listeners, nlisteners, ctl_fd);
+		}
+		if(ctl_fd != -1 && (fds[nlisteners + 1].revents & POLLIN) &&
+				hand_over(ctl_fd, listeners, nlisteners)){
+			// a new daemon took over the listening sockets
+			printf("Handed over to the new daemon\n");
+			for(i = 0; i < nlisteners; i++){
+				close(listeners[i]);
+			}
+			close(ctl_fd);
+			drain();
+		}
+		for(i = 0; i < nlisteners; i++){
+			if(!(fds[i].revents & POLLIN)){
+				continue;
+			}
+			// get the address size
+			addr_size = sizeof(their_addr);
+			// accept a new client
+			new_fd = accept(fds[i].fd, (struct sockaddr *)&their_addr, &addr_size);
+			// if there is no new client keep waiting
+			if(new_fd == -1){
+				if(errno != EAGAIN){
+					fprintf(stderr, "Error in accepting connection\n");
+				}
+				continue;
+			}
+			PROBE1(accept, new_fd);
+			// fork to let a new process handle the new socket
+			pid = fork();
+			// if there was an error, say so
+			if(pid == -1){
+				fprintf(stderr, "Error in fork\n");
+			}
+			else if(pid == 0){
+				// child process
+				int j;
+				for(j = 0; j < nlisteners; j++){
+					close(listeners[j]);
+				}
+				if(ctl_fd != -1){
+					close(ctl_fd);
+				}
+				close(signal_pipe[0]);
+				close(signal_pipe[1]);
+				signal(SIGCHLD, SIG_DFL);
+				signal(SIGTERM, SIG_DFL);
+				// the pads are the parent's to report on
+				signal(SIGUSR1, SIG_IGN);
+				handle_request(new_fd);
+				close(new_fd);
+				exit(0);
+			}
+			else{
+				// parent process, the child is reaped on SIGCHLD
+				close(new_fd);
+				add_child(pid);
+			}
+		}
+	}
+}
+
+/*******************************************************************************
+ * int parse_deadlines(char *)
+ *
+ * Reads the deadlines of -D, seconds for the handshake and optionally for
+ * receiving and for sending, separated by commas. 0 is no deadline
+ * Args: the deadlines
+ * Returns: 1 if they made sense, 0 if not
+ ******************************************************************************/
+int parse_deadlines(char * list){
+	static const int phases[] = {PHASE_HANDSHAKE, PHASE_RECEIVE, PHASE_SEND};
+	char * end;
+	int i;
+	for(i = 0; i < 3; i++){
+		long seconds = strtol(list, &end, 10);
+		if(end == list || seconds < 0){
+			return 0;
+		}
+		phase_limits[phases[i]] = seconds;
+		if(*end == '\0'){
+			return 1;
+		}
+		if(*end != ','){
+			return 0;
+		}
+		list = end + 1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+ * int main(int, char*)
+ * 
+ * main method. sets up server socket, command line args and calls 
+ * wait_for_connection
+ * Args: the command lin args
+ ******************************************************************************/
+int main(int argc, char *argv[]){
+	// the unix domain socket path, if any
+	char * unix_path = NULL;
+	// the control socket a restarted daemon takes over through, if any
+	char * ctl_path = NULL;
+	// whether -a picked the CPUs to run on
+	int cpus_given = 0;
+	char * usage = "Usage: otp_dec_d [-u socketpath] [-t threads] [-R jobdir] [-g graceseconds] [-c controlpath] [-d drainseconds] [-w workers] [-m arenamegabytes] [-H] [-L largebytes] [-J largeslots] [-W ageseconds] [-T tracefile] [-a cpulist] [-N] [-D handshake[,receive[,send]]] [-X totalseconds] [-M minbytespersecond] [-P padfile] [-K padfile] [port]\n";
+	char * end;
+	int opt;
+	while((opt = getopt(argc, argv, "u:t:R:g:c:d:w:m:HL:J:W:T:a:ND:X:M:P:K:")) != -1){
+		switch(opt){
+			case 'u':
+				unix_path = optarg;
+				break;
+			case 't':
+				cipher_threads = atoi(optarg);
+				if(cipher_threads < 1){
+					fprintf(stderr, "Invalid number of cipher threads\n");
+					exit(1);
+				}
+				break;
+			case 'R':
+				job_dir = optarg;
+				break;
+			case 'g':
+				job_grace = atoi(optarg);
+				break;
+			case 'c':
+				ctl_path = optarg;
+				break;
+			case 'd':
+				drain_seconds = atoi(optarg);
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				if(workers < 1){
+					fprintf(stderr, "Invalid number of workers\n");
+					exit(1);
+				}
+				break;
+			case 'm':
+				arena_cap = strtoll(optarg, &end, 10);
+				if(end == optarg || *end != '\0' || arena_cap < 0 ||
+						arena_cap > LLONG_MAX / (1024 * 1024)){
+					fprintf(stderr, "Invalid arena size %s\n%s", optarg, usage);
+					exit(1);
+				}
+				arena_cap *= 1024 * 1024;
+				break;
+			case 'H':
+				arena_huge_pages = 1;
+				break;
+			case 'L':
+				large_threshold = atoll(optarg);
+				break;
+			case 'J':
+				large_slots = atoi(optarg);
+				if(large_slots < 1){
+					fprintf(stderr, "Invalid number of large job slots\n");
+					exit(1);
+				}
+				break;
+			case 'W':
+				age_limit = atoi(optarg);
+				break;
+			case 'a':
+				if(!parse_cpulist(optarg, &allowed_cpus)){
+					fprintf(stderr, "Invalid CPU list %s\n", optarg);
+					exit(1);
+				}
+				cpus_given = 1;
+				break;
+			case 'N':
+				numa_placement = 1;
+				break;
+			case 'D':
+				if(!parse_deadlines(optarg)){
+					fprintf(stderr, "Invalid deadlines %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'X':
+				total_limit = atoi(optarg);
+				if(total_limit < 0){
+					fprintf(stderr, "Invalid total deadline\n");
+					exit(1);
+				}
+				break;
+			case 'M':
+				min_throughput = strtoll(optarg, NULL, 10);
+				if(min_throughput < 0){
+					fprintf(stderr, "Invalid minimum throughput\n");
+					exit(1);
+				}
+				break;
+			case 'P':
+			case 'K':
+				if(npads == MAX_PADS){
+					fprintf(stderr, "Too many pads, at most %d\n", MAX_PADS);
+					exit(1);
+				}
+				// -K also keeps it locked in memory
+				pads[npads].path = optarg;
+				pads[npads++].locked = opt == 'K';
+				break;
+			case 'T':
+				// every process appends its own records
+				trace_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+				if(trace_fd == -1){
+					fprintf(stderr, "There was an error opening %s\n", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				fprintf(stderr, "%s", usage);
+				exit(1);
+		}
+	}
+	// need a port, a socket path or both, unless taking over from a daemon
+	if(argc - optind > 1 ||
+			(argc - optind == 0 && unix_path == NULL && ctl_path == NULL)){
+		fprintf(stderr, "Invalid number of arguments\n");
+		exit(1);
+	}
+	daemon_pid = getpid();
+	// resumable jobs are kept under $TMPDIR unless told otherwise
+	char default_job_dir[4096];
+	if(job_dir == NULL){
+		snprintf(default_job_dir, sizeof(default_job_dir), "%s/otp_dec_d.jobs",
+				getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp");
+		job_dir = default_job_dir;
+	}
+	// the default is in a shared directory, where anyone could make it first
+	if(!job_dir_safe()){
+		fprintf(stderr, "Unsafe job directory %s, it has to be ours and writable by nobody else\n",
+				job_dir);
+		exit(1);
+	}
+	// read the pads in before the first request can want them
+	map_pads();
+	report_pads();
+	int listeners[2];
+	int nlisteners = 0;
+	int ctl_fd = -1;
+	if(ctl_path != NULL){
+		// a daemon on the control socket hands over its listening sockets
+		nlisteners = take_over(ctl_path, listeners);
+		if(nlisteners > 0){
+			printf("Took over from the running daemon\n");
+		}
+	}
+	int took_over = nlisteners > 0;
+	if(!took_over && optind < argc){
+		printf("Server open on port %s\n", argv[optind]);
+		// create address info with the port number
+		struct addrinfo * res = create_address_info(argv[optind]);
+		// create socket with this address info
+		int sockfd = create_socket(res);
+		// bind this socket to the port
+		bind_socket(sockfd, res);
+		// listen on the port
+		listen_socket(sockfd);
+		listeners[nlisteners++] = sockfd;
+		// the address is not needed once bound
+		freeaddrinfo(res);
+	}
+	if(!took_over && unix_path != NULL){
+		printf("Server open on socket %s\n", unix_path);
+		// listen on the local socket alongside the port
+		listeners[nlisteners++] = create_unix_socket(unix_path);
+	}
+	if(phase_limits[PHASE_HANDSHAKE] > 0){
+		// clients used to get as long as they liked, say that they do not
+		printf("Handshake deadline %d seconds, -D 0 turns it off\n",
+				phase_limits[PHASE_HANDSHAKE]);
+	}
+	int i;
+	for(i = 0; i < nlisteners; i++){
+		// workers race to accept, the losers go back to waiting
+		fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK);
+	}
+	if(ctl_path != NULL){
+		// be the daemon the next restart takes over from, only our own
+		// user gets to connect
+		mode_t old_mask = umask(077);
+		ctl_fd = create_unix_socket(ctl_path);
+		umask(old_mask);
+	}
+	// large jobs queue up across every process the daemon forks
+	sched_init();
+	stalled = mmap(NULL, sizeof(*stalled), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(stalled == MAP_FAILED){
+		fprintf(stderr, "Error creating stall counter\n");
+		exit(1);
+	}
+	// run on the CPUs asked for, or wherever we were allowed to already
+	if(cpus_given && sched_setaffinity(0, sizeof(allowed_cpus), &allowed_cpus) == -1){
+		fprintf(stderr, "Error setting CPU affinity\n");
+		exit(1);
+	}
+	sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus);
+	numa_init();
+	// reap children and shut down through the signal pipe
+	struct sigaction sa;
+	if(pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) == -1){
+		fprintf(stderr, "Error creating signal pipe\n");
+		exit(1);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	// wait for up to 5 incoming connections
+	wait_for_connection(listeners, nlisteners, ctl_fd);
+}
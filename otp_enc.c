@@ -14,7 +14,40 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include "otp_cipher.h"
 
+// size of the pieces large transfers are broken into
+#define CHUNK_SIZE (64 * 1024)
+// each parallel stream gets at least this much of the file
+#define MIN_STREAM_SIZE (1024 * 1024)
+// length of the id of a resumable job, in hex digits
+#define JOB_ID_SIZE 32
+// how many validated files the cache remembers
+#define CACHE_ENTRIES 64
+
+// whether the files are arbitrary bytes to XOR with the key instead of text
+int binary = 0;
+// whether the files are handed to the daemon as descriptors, not sent
+int pass_fds = 0;
+// whether the message is streamed in frames because its length is unknown
+int chunked = 0;
+// whether the message is streamed a chunk at a time with the matching key
+int interleaved = 0;
+// the alphabet a text message and key are written in
+const struct alphabet * alphabet = &alphabets[0];
+// messages up to this long are enciphered here instead of by the daemon,
+// -1 to always use the daemon
+long long local_threshold = -1;
 
 /*******************************************************************************
  * struct addrinfo * create_address_info(char*)
@@ -52,7 +85,7 @@ struct addrinfo * create_address_info(char * port){
  ******************************************************************************/
 int create_socket(struct addrinfo * res){
 	int sockfd;
-	if ((sockfd = socket((struct addrinfo *)(res)->ai_family, res->ai_socktype, res->ai_protocol)) == -1){
+	if ((sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1){
 		fprintf(stderr, "Error in creating socket\n");
 		exit(1);
 	}
@@ -73,6 +106,35 @@ void connect_socket(int sockfd, struct addrinfo * res){
 	}
 }
 
+/*******************************************************************************
+ * int connect_unix_socket(char *)
+ * 
+ * Connects to a daemon listening on a unix domain socket on this host
+ * Args: the path of the socket
+ * Returns: a connected socket file descriptor
+ ******************************************************************************/
+int connect_unix_socket(char * path){
+	struct sockaddr_un addr;
+	int sockfd;
+	// make sure the path fits in the address
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "Socket path is too long: %s\n", path);
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+		fprintf(stderr, "Error in creating socket\n");
+		exit(1);
+	}
+	if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+		fprintf(stderr, "Error in connecting socket\n");
+		exit(1);
+	}
+	return sockfd;
+}
+
 /*******************************************************************************
  * void send_file(int, int)
  *
@@ -89,6 +151,10 @@ void send_file(int fd, int sockfd) {
 	while (1) {
 		// grab data from the file
 		nread = read(fd, buffer, sizeof(buffer));
+		if (nread < 0) {
+			fprintf(stderr, "Error reading file\n");
+			exit(1);
+		}
 		if (nread == 0) {
 			// done, close fd
 			close(fd);
@@ -105,8 +171,10 @@ void send_file(int fd, int sockfd) {
 		}
 	}
 	memset(buffer, '\0', sizeof(buffer));
-	//read the confirmation from daemon
-	nread = read(sockfd, buffer, sizeof(buffer));
+	//read the confirmation from daemon, and only the confirmation, so that
+	//the start of the reply is not swallowed when the two arrive together
+	char * finished = "opt_enc_d f";
+	recv(sockfd, buffer, strlen(finished), MSG_WAITALL);
 }
 
 /*******************************************************************************
@@ -117,7 +185,15 @@ void send_file(int fd, int sockfd) {
  ******************************************************************************/
 int handshake(int sockfd){
 	//	printf("Verifying identity with daemon\n");
-	char * identity = "opt_enc";
+	char identity[80];
+	snprintf(identity, sizeof(identity), "opt_enc%s%s%s%s", binary ? " xor" : "",
+			pass_fds ? " fds" : "", chunked ? " chunked" : "",
+			interleaved ? " interleaved" : "");
+	// the default alphabet goes unnamed, for daemons that know no other
+	if(!binary && alphabet != &alphabets[0]){
+		snprintf(identity + strlen(identity), sizeof(identity) - strlen(identity),
+				" alphabet=%s", alphabet->name);
+	}
 	send(sockfd, identity, strlen(identity),0);
 	// get the response from the server
 	char buffer[100];
@@ -132,60 +208,292 @@ int handshake(int sockfd){
 }
 
 /*******************************************************************************
- * char * recv_file(int, int)
+ * long long splice_file(int, int, long long, long long)
+ *
+ * Moves bytes from the socket to the output without copying them through
+ * user space. Pipes are spliced into directly, regular files go through an
+ * intermediate pipe, anything else is left to recv_file
+ * Args: a socket file descriptor, the output descriptor, the length and the
+ *       offset to write at in the output, or -1 for its current position
+ * Returns: how many bytes were moved
+ ******************************************************************************/
+long long splice_file(int new_fd, int out_fd, long long message_length,
+		long long out_offset){
+	struct stat st;
+	int pipefd[2];
+	loff_t offset = out_offset;
+	ssize_t nread;
+	ssize_t nwrite;
+	long long i = 0;
+	if(fstat(out_fd, &st) == -1){
+		return 0;
+	}
+	if(S_ISFIFO(st.st_mode) && out_offset == -1){
+		// straight from the socket into the pipe
+		for(; i < message_length; i += nread){
+			nread = splice(new_fd, NULL, out_fd, NULL, message_length - i,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(nread <= 0){
+				fprintf(stderr, "Error in receiving file\n");
+				_Exit(2);
+			}
+		}
+		return i;
+	}
+	// splice cannot write to files opened for appending
+	if(!S_ISREG(st.st_mode) || (fcntl(out_fd, F_GETFL) & O_APPEND) ||
+			pipe(pipefd) == -1){
+		return 0;
+	}
+	// socket into the pipe, pipe into the file
+	for(; i < message_length; i += nread){
+		nread = splice(new_fd, NULL, pipefd[1], NULL,
+				message_length - i < CHUNK_SIZE ? message_length - i : CHUNK_SIZE,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(nread <= 0){
+			fprintf(stderr, "Error in receiving file\n");
+			_Exit(2);
+		}
+		for(ssize_t j = 0; j < nread; j += nwrite){
+			nwrite = splice(pipefd[0], NULL, out_fd,
+					out_offset == -1 ? NULL : &offset, nread - j,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(nwrite <= 0){
+				fprintf(stderr, "Error writing output\n");
+				_Exit(2);
+			}
+		}
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return i;
+}
+
+/*******************************************************************************
+ * void recv_file(int, long long, int, long long)
  *
- * Receives a file of a specified size and returns its contents in a string
- * Args: a socket file descriptor and a message length
+ * Receives a file of a specified size and writes each chunk to the output
+ * as it arrives, so the whole file never has to fit in memory and whatever
+ * reads the output can start on the first bytes
+ * Args: a socket file descriptor, a message length, the output descriptor
+ *       and the offset to write at in it, or -1 for its current position
  ******************************************************************************/
-char * recv_file(int new_fd, int message_length){
+void recv_file(int new_fd, long long message_length, int out_fd,
+		long long out_offset){
 	// allocate a receive buffer and read variables
-	char * to_receive = malloc(message_length * sizeof(char));
-	int nread = 0;
-	int i = 0;
-	// begin receiving the file
+	char to_receive[CHUNK_SIZE];
+	ssize_t nread = 0;
+	ssize_t nwrite;
+	// use splice when the output allows it
+	long long i = splice_file(new_fd, out_fd, message_length, out_offset);
+	// begin receiving the rest of the file
 	for(; i< message_length; i+= nread){
-		nread = read(new_fd, to_receive + i, message_length -i);
-		if(nread < 0){
+		nread = read(new_fd, to_receive,
+				message_length - i < CHUNK_SIZE ? message_length - i : CHUNK_SIZE);
+		if(nread <= 0){
 			fprintf(stderr, "Error in receiving file\n");
 			_Exit(2);
 		}
+		for(ssize_t j = 0; j < nread; j += nwrite){
+			if(out_offset == -1){
+				nwrite = write(out_fd, to_receive + j, nread - j);
+			}
+			else{
+				nwrite = pwrite(out_fd, to_receive + j, nread - j,
+						out_offset + i + j);
+			}
+			if(nwrite < 0){
+				fprintf(stderr, "Error writing output\n");
+				_Exit(2);
+			}
+		}
 	}
 	// echo finished response
 	char * finished = "opt_enc_d f";
 	send(new_fd, finished, strlen(finished),0);
-	return to_receive;
+}
+
+// a file known to contain only valid characters, as long as none of this
+// has changed. Fixed width, so the cache reads the same in every build
+struct valid_entry {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	// what it was valid in, a file of one alphabet may not be of another
+	char alphabet[16];
+};
+
+/*******************************************************************************
+ * int cache_path(char *, size_t)
+ *
+ * Finds where the validation cache lives: $OTP_CACHE, or otp_valid in the
+ * user's cache directory
+ * Args: a buffer for the path and its size
+ * Returns: 1 if there is somewhere to keep it, 0 if not
+ ******************************************************************************/
+int cache_path(char * path, size_t size){
+	char * env = getenv("OTP_CACHE");
+	int n;
+	if(env != NULL){
+		n = snprintf(path, size, "%s", env);
+	} else if((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0'){
+		n = snprintf(path, size, "%s/otp_valid", env);
+	} else if((env = getenv("HOME")) != NULL && *env != '\0'){
+		// the directory may not be there yet on a fresh account
+		n = snprintf(path, size, "%s/.cache", env);
+		if(n > 0 && (size_t)n < size){
+			mkdir(path, 0700);
+		}
+		n = snprintf(path, size, "%s/.cache/otp_valid", env);
+	} else {
+		return 0;
+	}
+	return *path != '\0' && n > 0 && (size_t)n < size;
 }
 
 /*******************************************************************************
- * int check_file_and_get_length(int)
+ * int read_cache(struct valid_entry *)
  *
- * Gets the file's length and makes sure it contains valid characters
+ * Reads the validation cache, most recently validated file first. A missing
+ * or unreadable cache is an empty one
+ * Args: room for CACHE_ENTRIES entries
+ * Returns: how many entries were read
+ ******************************************************************************/
+int read_cache(struct valid_entry * entries){
+	char path[4096];
+	if(!cache_path(path, sizeof(path))){
+		return 0;
+	}
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return 0;
+	}
+	ssize_t nread = read(fd, entries, CACHE_ENTRIES * sizeof(*entries));
+	close(fd);
+	return nread > 0 ? nread / sizeof(*entries) : 0;
+}
+
+/*******************************************************************************
+ * void remember_valid(struct valid_entry *)
+ *
+ * Puts a file at the front of the validation cache, dropping the least
+ * recently validated one when it is full. The new cache is renamed over the
+ * old one, so clients running at once never see half of it, at worst one
+ * of their entries is lost
+ * Args: the file's entry
+ ******************************************************************************/
+void remember_valid(struct valid_entry * entry){
+	struct valid_entry entries[CACHE_ENTRIES];
+	struct valid_entry old[CACHE_ENTRIES];
+	char path[4096];
+	char tmp[4096 + 32];
+	int nold = read_cache(old);
+	int n = 1;
+	int i;
+	if(!cache_path(path, sizeof(path))){
+		return;
+	}
+	entries[0] = *entry;
+	for(i = 0; i < nold && n < CACHE_ENTRIES; i++){
+		// another file now at the same inode takes over its entry
+		if(old[i].dev != entry->dev || old[i].ino != entry->ino){
+			entries[n++] = old[i];
+		}
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0){
+		return;
+	}
+	ssize_t size = n * sizeof(*entries);
+	if(write(fd, entries, size) != size || close(fd) == -1 ||
+			rename(tmp, path) == -1){
+		unlink(tmp);
+	}
+}
+
+/*******************************************************************************
+ * void fill_entry(struct stat *, struct valid_entry *)
+ *
+ * Makes the validation cache entry of a file
+ * Args: the file's status and the entry to fill in
+ ******************************************************************************/
+void fill_entry(struct stat * st, struct valid_entry * entry){
+	memset(entry, 0, sizeof(*entry));
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime_sec = st->st_mtim.tv_sec;
+	entry->mtime_nsec = st->st_mtim.tv_nsec;
+	entry->ctime_sec = st->st_ctim.tv_sec;
+	entry->ctime_nsec = st->st_ctim.tv_nsec;
+	strncpy(entry->alphabet, alphabet->name, sizeof(entry->alphabet) - 1);
+}
+
+/*******************************************************************************
+ * long long check_file_and_get_length(int)
+ *
+ * Gets the file's length and makes sure it contains valid characters. A
+ * regular file already validated and unchanged since is not read again
  * Args: a file descriptor
  ******************************************************************************/
-int check_file_and_get_length(int fd){
+long long check_file_and_get_length(int fd){
 	// allocate buffer
-	char buffer[100];
-	memset(buffer, 0, sizeof(buffer));
-	// go through file 1 char at a time and check for invalid chars
-	while(read(fd, buffer, 1) != 0){
-		if(((buffer[0] < 'A' || buffer[0] > 'Z') &&
-			buffer[0] != ' ') && buffer[0] != '\n'){
-			fprintf(stderr, "File contains invalid characters\n");
-			exit(1);
+	char buffer[CHUNK_SIZE];
+	struct valid_entry entries[CACHE_ENTRIES];
+	struct valid_entry before;
+	struct valid_entry after;
+	struct stat st;
+	ssize_t nread;
+	ssize_t i;
+	int cacheable = !binary && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	if(cacheable){
+		fill_entry(&st, &before);
+		int n = read_cache(entries);
+		for(i = 0; i < n; i++){
+			if(memcmp(&entries[i], &before, sizeof(before)) == 0){
+				return st.st_size;
+			}
+		}
+	}
+	// go through file a block at a time and check for invalid chars,
+	// any byte goes in binary mode
+	while(!binary && (nread = read(fd, buffer, sizeof(buffer))) > 0){
+		for(i = 0; i < nread; i++){
+			if(alphabet->valid[(unsigned char)buffer[i]] == ALPHABET_INVALID){
+				fprintf(stderr, "File contains invalid characters\n");
+				exit(1);
+			}
+		}
+	}
+	long long length = lseek(fd, 0, SEEK_END);
+	// only remember a file that did not change while it was read, and that
+	// has settled: a write in the same clock tick as the last one would
+	// leave its times as they are
+	if(cacheable && fstat(fd, &st) == 0){
+		fill_entry(&st, &after);
+		if(memcmp(&before, &after, sizeof(before)) == 0 &&
+				st.st_ctim.tv_sec < time(NULL) - 1){
+			remember_valid(&after);
 		}
 	}
 	// return its length
-	return lseek(fd, 0, SEEK_END);
+	return length;
 }
 
 
 /*******************************************************************************
- * void handle_request(int, char *, char *)
+ * void handle_request(int, char *, char *, int)
  *
  * handles the request to the daemon
- * Args: a socket file descriptor, a file name and a key name
+ * Args: a socket file descriptor, a file name, a key name and the descriptor
+ *       to write the result to
  ******************************************************************************/
-void handle_request(int sockfd, char * filename, char * keyname){
+void handle_request(int sockfd, char * filename, char * keyname, int out_fd){
 	// begin by verifying identity
 	int is_valid = handshake(sockfd);
 	if(!is_valid){
@@ -203,9 +511,9 @@ void handle_request(int sockfd, char * filename, char * keyname){
 		fprintf(stderr, "Error opening file\n");
 		exit(1);
 	}
-	//printf("Getting file and key length\n");
-	int file_length = check_file_and_get_length(file_fd);
-	int key_length = check_file_and_get_length(key_fd);
+	// main has checked them already
+	long long file_length = lseek(file_fd, 0, SEEK_END);
+	long long key_length = lseek(key_fd, 0, SEEK_END);
 	if(file_length > key_length){
 		fprintf(stderr, "Error: Key is too short\n");
 		exit(1);
@@ -217,8 +525,8 @@ void handle_request(int sockfd, char * filename, char * keyname){
 	memset(file_length_s, 0, sizeof(file_length_s));
 	char key_length_s[20];
 	memset(key_length_s, 0, sizeof(key_length_s));
-	sprintf(file_length_s, "%d", file_length);
-	sprintf(key_length_s, "%d", key_length);
+	sprintf(file_length_s, "%lld", file_length);
+	sprintf(key_length_s, "%lld", key_length);
 	// Sending the length of the file and echoing back
 	send(sockfd, file_length_s, strlen(file_length_s), 0);
 	recv(sockfd, file_length_s, sizeof(file_length_s), 0);
@@ -233,11 +541,832 @@ void handle_request(int sockfd, char * filename, char * keyname){
 	// close the files
 	close(filefd);
 	close(keyfd);
-	// get the encrypted file back
-	char * encrypted = recv_file(sockfd, file_length);
-	// print it and free the space
-	printf("%s", encrypted);
-	free(encrypted);
+	// get the encrypted file back and print it as it arrives
+	recv_file(sockfd, file_length, out_fd, -1);
+}
+
+/*******************************************************************************
+ * int connect_to_daemon(char *, char *)
+ *
+ * Connects to the daemon over its unix domain socket when a path is given,
+ * or over TCP on the port otherwise
+ * Args: the socket path or NULL, and the port number
+ * Returns: a connected socket file descriptor
+ ******************************************************************************/
+int connect_to_daemon(char * unix_path, char * port){
+	if(unix_path != NULL){
+		// same host, skip the TCP/IP stack
+		return connect_unix_socket(unix_path);
+	}
+	struct addrinfo * res = create_address_info(port);
+	int sockfd = create_socket(res);
+	connect_socket(sockfd, res);
+	freeaddrinfo(res);
+	return sockfd;
+}
+
+/*******************************************************************************
+ * void send_range(int, int, long long, long long)
+ *
+ * Sends part of a file over the socket, letting the kernel copy it straight
+ * from the page cache
+ * Args: a file descriptor, a socket file descriptor, the offset of the part
+ *       and its length
+ ******************************************************************************/
+void send_range(int fd, int sockfd, long long offset, long long length){
+	off_t off = offset;
+	ssize_t nwrite;
+	while(off < offset + length){
+		nwrite = sendfile(sockfd, fd, &off, offset + length - off);
+		if(nwrite <= 0){
+			fprintf(stderr, "Error writing to socket\n");
+			exit(1);
+		}
+	}
+	//read the confirmation from daemon
+	char buffer[20];
+	char * finished = "opt_enc_d f";
+	recv(sockfd, buffer, strlen(finished), MSG_WAITALL);
+}
+
+/*******************************************************************************
+ * void request_range(int, char *, char *, long long, long long, int, long long)
+ *
+ * Has the daemon encrypt one range of the file with the same range of the
+ * key, as a request of its own, and writes the result to the output
+ * Args: a socket file descriptor that has done the handshake, a file name,
+ *       a key name, the offset and length of the range, the output descriptor
+ *       and where in it to write, or -1 for its current position
+ ******************************************************************************/
+void request_range(int sockfd, char * filename, char * keyname, long long offset,
+		long long length, int out_fd, long long out_offset){
+	int file_fd = open(filename, O_RDONLY);
+	int key_fd = open(keyname, O_RDONLY);
+	if(file_fd < 0 || key_fd < 0){
+		fprintf(stderr, "Error opening file or key\n");
+		exit(1);
+	}
+	// the range is both the message and the key length
+	char length_s[24];
+	memset(length_s, 0, sizeof(length_s));
+	sprintf(length_s, "%lld", length);
+	send(sockfd, length_s, strlen(length_s), 0);
+	recv(sockfd, length_s, sizeof(length_s), 0);
+	sprintf(length_s, "%lld", length);
+	send(sockfd, length_s, strlen(length_s), 0);
+	recv(sockfd, length_s, sizeof(length_s), 0);
+	send_range(file_fd, sockfd, offset, length);
+	send_range(key_fd, sockfd, offset, length);
+	close(file_fd);
+	close(key_fd);
+	recv_file(sockfd, length, out_fd, out_offset);
+}
+
+/*******************************************************************************
+ * int create_spool_file()
+ *
+ * Creates an unlinked temporary file to hold the result of a range until the
+ * ranges before it have been written out. It lives in $TMPDIR, or /tmp
+ * Returns: the spool file descriptor
+ ******************************************************************************/
+int create_spool_file(){
+	char path[4096];
+	char * dir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/otp_enc.XXXXXX",
+			dir != NULL ? dir : "/tmp");
+	int spool_fd = mkstemp(path);
+	if(spool_fd == -1){
+		fprintf(stderr, "Error creating spool file in %s\n", path);
+		exit(1);
+	}
+	// nobody else needs the name, the file goes away with the descriptor
+	unlink(path);
+	return spool_fd;
+}
+
+/*******************************************************************************
+ * void copy_spool(int, int, long long)
+ *
+ * Copies a spool file to the output, in the kernel where the output allows
+ * it and through a buffer where it does not
+ * Args: the spool file descriptor, the output descriptor and the length
+ ******************************************************************************/
+void copy_spool(int spool_fd, int out_fd, long long length){
+	char buffer[CHUNK_SIZE];
+	off_t off = 0;
+	ssize_t nread;
+	ssize_t nwrite;
+	while(off < length){
+		nwrite = sendfile(out_fd, spool_fd, &off, length - off);
+		if(nwrite <= 0){
+			break;
+		}
+	}
+	for(; off < length; off += nread){
+		nread = pread(spool_fd, buffer,
+				length - off < CHUNK_SIZE ? length - off : CHUNK_SIZE, off);
+		if(nread <= 0){
+			fprintf(stderr, "Error reading spool file\n");
+			exit(1);
+		}
+		for(ssize_t j = 0; j < nread; j += nwrite){
+			nwrite = write(out_fd, buffer + j, nread - j);
+			if(nwrite < 0){
+				fprintf(stderr, "Error writing output\n");
+				exit(1);
+			}
+		}
+	}
+}
+
+/*******************************************************************************
+ * void handle_parallel(char *, char *, char *, char *, int, int)
+ *
+ * Splits the file and key into ranges and sends each range over its own
+ * connection from its own process, so one stream does not cap the transfer.
+ * When the output is a regular file each range is written in place,
+ * otherwise the first range goes straight to the output and the others are
+ * spooled and copied out in order once they are all done
+ * Args: the socket path or NULL, the port number, a file name, a key name,
+ *       the number of streams and the output descriptor
+ ******************************************************************************/
+void handle_parallel(char * unix_path, char * port, char * filename,
+		char * keyname, int streams, int out_fd){
+	struct stat file_st;
+	struct stat key_st;
+	if(stat(filename, &file_st) == -1 || stat(keyname, &key_st) == -1){
+		fprintf(stderr, "Error opening file or key\n");
+		exit(1);
+	}
+	long long file_length = file_st.st_size;
+	if(file_length > key_st.st_size){
+		fprintf(stderr, "Error: Key is too short\n");
+		exit(1);
+	}
+	// do not split into ranges too small to be worth a connection
+	if(file_length / MIN_STREAM_SIZE < streams){
+		streams = file_length / MIN_STREAM_SIZE;
+	}
+	if(streams < 2){
+		int sockfd = connect_to_daemon(unix_path, port);
+		handle_request(sockfd, filename, keyname, out_fd);
+		close(sockfd);
+		return;
+	}
+	// connect every stream before starting any
+	int * sockfds = malloc(streams * sizeof(int));
+	int * spools = malloc(streams * sizeof(int));
+	pid_t * pids = malloc(streams * sizeof(pid_t));
+	if(sockfds == NULL || spools == NULL || pids == NULL){
+		fprintf(stderr, "Error allocating streams\n");
+		exit(1);
+	}
+	int i;
+	for(i = 0; i < streams; i++){
+		sockfds[i] = connect_to_daemon(unix_path, port);
+	}
+	// regular files not opened for appending can be written in place
+	struct stat out_st;
+	long long base = -1;
+	if(fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode) &&
+			!(fcntl(out_fd, F_GETFL) & O_APPEND)){
+		base = lseek(out_fd, 0, SEEK_CUR);
+	}
+	for(i = 0; i < streams; i++){
+		spools[i] = -1;
+		if(base == -1 && i > 0){
+			spools[i] = create_spool_file();
+		}
+	}
+	// start a process for each range
+	for(i = 0; i < streams; i++){
+		long long offset = file_length * i / streams;
+		long long length = file_length * (i + 1) / streams - offset;
+		pids[i] = fork();
+		if(pids[i] == -1){
+			fprintf(stderr, "Error in fork\n");
+			exit(1);
+		}
+		if(pids[i] == 0){
+			// each stream verifies identity on its own, a daemon with fewer
+			// workers than streams gets to the rest as the first ones finish
+			if(!handshake(sockfds[i])){
+				fprintf(stderr,"Daemon did not accept client\n");
+				exit(1);
+			}
+			if(base != -1){
+				request_range(sockfds[i], filename, keyname, offset, length,
+						out_fd, base + offset);
+			}
+			else if(i == 0){
+				request_range(sockfds[i], filename, keyname, offset, length,
+						out_fd, -1);
+			}
+			else{
+				request_range(sockfds[i], filename, keyname, offset, length,
+						spools[i], 0);
+			}
+			exit(0);
+		}
+		close(sockfds[i]);
+	}
+	// wait for every range, any failure fails the whole file
+	int status;
+	int failed = 0;
+	for(i = 0; i < streams; i++){
+		if(waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) ||
+				WEXITSTATUS(status) != 0){
+			failed = 1;
+		}
+	}
+	if(failed){
+		fprintf(stderr, "Error in one of the streams\n");
+		exit(1);
+	}
+	if(base != -1){
+		// leave the output positioned after the file
+		lseek(out_fd, base + file_length, SEEK_SET);
+	}
+	else{
+		// copy the spooled ranges out in order
+		for(i = 1; i < streams; i++){
+			copy_spool(spools[i], out_fd, file_length * (i + 1) / streams -
+					file_length * i / streams);
+			close(spools[i]);
+		}
+	}
+	free(sockfds);
+	free(spools);
+	free(pids);
+}
+
+/*******************************************************************************
+ * void send_fds(int, int *, int)
+ *
+ * Sends file descriptors over a unix domain socket
+ * Args: the socket, the file descriptors and how many there are
+ ******************************************************************************/
+void send_fds(int sockfd, int * fds, int nfds){
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	char count = nfds;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &count;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	if(sendmsg(sockfd, &msg, 0) != 1){
+		fprintf(stderr, "Error passing files to the daemon\n");
+		exit(1);
+	}
+}
+
+/*******************************************************************************
+ * void handle_fds(int, char *, char *, int)
+ *
+ * Handles a request on the same host without sending the files at all: the
+ * file, key and output descriptors are passed over the unix domain socket
+ * and the daemon encrypts straight from the file into the output through
+ * memory mappings. An output the daemon cannot map, like a pipe or a file
+ * opened for appending, is stood in for by a memory file copied out after
+ * Args: a unix domain socket, a file name, a key name and where to put the
+ *       result
+ ******************************************************************************/
+void handle_fds(int sockfd, char * filename, char * keyname, int out_fd){
+	char buffer[24];
+	struct stat file_st;
+	struct stat key_st;
+	struct stat out_st;
+	int fds[3];
+	if(!handshake(sockfd)){
+		fprintf(stderr,"Daemon did not accept client\n");
+		exit(1);
+	}
+	fds[0] = open(filename, O_RDONLY);
+	fds[1] = open(keyname, O_RDONLY);
+	if(fds[0] < 0 || fds[1] < 0 || fstat(fds[0], &file_st) == -1 ||
+			fstat(fds[1], &key_st) == -1){
+		fprintf(stderr, "Error opening file or key\n");
+		exit(1);
+	}
+	long long file_length = file_st.st_size;
+	if(file_length > key_st.st_size){
+		fprintf(stderr, "Error: Key is too short\n");
+		exit(1);
+	}
+	// the daemon writes through a shared mapping, which needs read access
+	fds[2] = out_fd;
+	if(fstat(out_fd, &out_st) == -1 || !S_ISREG(out_st.st_mode) ||
+			(fcntl(out_fd, F_GETFL) & (O_APPEND | O_ACCMODE)) != O_RDWR ||
+			lseek(out_fd, 0, SEEK_CUR) != 0){
+		fds[2] = memfd_create("otp_enc", 0);
+		if(fds[2] == -1){
+			fprintf(stderr, "Error creating memory file\n");
+			exit(1);
+		}
+	}
+	// Sending the length of the file and echoing back
+	snprintf(buffer, sizeof(buffer), "%lld", file_length);
+	send(sockfd, buffer, strlen(buffer), 0);
+	recv(sockfd, buffer, sizeof(buffer), 0);
+	// sending the length of the key and echoing back
+	snprintf(buffer, sizeof(buffer), "%lld", (long long)key_st.st_size);
+	send(sockfd, buffer, strlen(buffer), 0);
+	recv(sockfd, buffer, sizeof(buffer), 0);
+	send_fds(sockfd, fds, 3);
+	// the daemon says when the output is written
+	char * finished = "opt_enc_d f";
+	memset(buffer, 0, sizeof(buffer));
+	if(recv(sockfd, buffer, strlen(finished), MSG_WAITALL) !=
+			(ssize_t)strlen(finished) || strcmp(buffer, finished) != 0){
+		fprintf(stderr, "Error in receiving file\n");
+		exit(1);
+	}
+	if(fds[2] != out_fd){
+		copy_spool(fds[2], out_fd, file_length);
+		close(fds[2]);
+	}
+	else{
+		// leave the output positioned after the file, as if written to
+		lseek(out_fd, file_length, SEEK_SET);
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/*******************************************************************************
+ * void write_all(int, char *, long long)
+ *
+ * Writes the whole of a buffer, however many writes it takes
+ * Args: a file descriptor, the buffer and its length
+ ******************************************************************************/
+void write_all(int fd, char * buffer, long long length){
+	ssize_t nwrite;
+	long long i = 0;
+	for(; i < length; i += nwrite){
+		nwrite = write(fd, buffer + i, length - i);
+		if(nwrite < 0){
+			fprintf(stderr, "Error writing output\n");
+			exit(1);
+		}
+	}
+}
+
+/*******************************************************************************
+ * struct upload
+ *
+ * What the thread sending a streamed message works with, and what it tells
+ * the thread receiving the result once the whole message is out
+ ******************************************************************************/
+struct upload {
+	int sockfd;
+	int fd;
+	int key_fd;
+	long long key_length;
+	// how long the message is when it is interleaved, -1 in frames
+	long long length;
+	// set once the last frame is sent, to how long the message was
+	long long total;
+	int done;
+};
+
+/*******************************************************************************
+ * void * upload_frames(void *)
+ *
+ * Sends a streamed message in frames as it is read: a 4 byte length in
+ * network byte order, that many bytes of the message, then as many of the
+ * key. An empty frame ends the message. An interleaved message has a known
+ * length, so it goes without headers or the empty frame, in chunks of
+ * exactly CHUNK_SIZE bytes but the last, each followed by its key
+ * Args: the upload
+ ******************************************************************************/
+void * upload_frames(void * arg){
+	struct upload * up = arg;
+	// each frame goes out in one write, so Nagle's algorithm does not hold
+	// back the message behind its header
+	char frame[sizeof(uint32_t) + 2 * CHUNK_SIZE];
+	size_t header_size = up->length < 0 ? sizeof(uint32_t) : 0;
+	char * message = frame + header_size;
+	uint32_t header;
+	ssize_t nread;
+	ssize_t i;
+	long long sent = 0;
+	for(;;){
+		if(up->length < 0){
+			nread = read(up->fd, message, CHUNK_SIZE);
+		}
+		else{
+			// the daemon expects chunks of just this size
+			nread = up->length - sent < CHUNK_SIZE ? up->length - sent : CHUNK_SIZE;
+			if(nread > 0 && pread(up->fd, message, nread, sent) != nread){
+				fprintf(stderr, "Error reading file\n");
+				exit(1);
+			}
+		}
+		if(nread <= 0){
+			break;
+		}
+		for(i = 0; i < nread && !binary; i++){
+			if(alphabet->valid[(unsigned char)message[i]] == ALPHABET_INVALID){
+				fprintf(stderr, "File contains invalid characters\n");
+				exit(1);
+			}
+		}
+		if(sent + nread > up->key_length){
+			fprintf(stderr, "Error: Key is too short\n");
+			exit(1);
+		}
+		if(pread(up->key_fd, message + nread, nread, sent) != nread){
+			fprintf(stderr, "Error reading key\n");
+			exit(1);
+		}
+		header = htonl(nread);
+		memcpy(frame, &header, header_size);
+		write_all(up->sockfd, frame, header_size + 2 * nread);
+		sent += nread;
+	}
+	if(nread < 0){
+		fprintf(stderr, "Error reading file\n");
+		exit(1);
+	}
+	if(up->length >= 0){
+		return NULL;
+	}
+	// the receiving side has to know where the result ends before the
+	// daemon can send what comes after it
+	up->total = sent;
+	__atomic_store_n(&up->done, 1, __ATOMIC_RELEASE);
+	header = 0;
+	write_all(up->sockfd, (char *)&header, sizeof(header));
+	return NULL;
+}
+
+/*******************************************************************************
+ * void handle_stream(int, int, char *, int, long long)
+ *
+ * Handles a request for a message of unknown length, like one from a pipe.
+ * After the "chunked" handshake its length is sent as -1, and the message
+ * goes over in frames from a thread of its own while this one writes out
+ * the result as the daemon sends each frame back, so the two directions
+ * overlap and neither side's buffers fill up waiting on the other. A file
+ * sent with -d goes the same way after the "interleaved" handshake, but
+ * with its real length, so the daemon still checks it against the key and
+ * schedules it by size. The key has to be a file, to know its length
+ * Args: a socket file descriptor, the message file descriptor, a key name,
+ *       where to put the result, and the message length or -1
+ ******************************************************************************/
+void handle_stream(int sockfd, int fd, char * keyname, int out_fd,
+		long long length){
+	char buffer[CHUNK_SIZE];
+	char * finished = "opt_enc_d f";
+	char trailer[24];
+	size_t ntrailer = 0;
+	struct stat key_st;
+	struct upload up;
+	pthread_t uploader;
+	ssize_t nread;
+	long long received = 0;
+	int one = 1;
+	if(!handshake(sockfd)){
+		fprintf(stderr,"Daemon did not accept client\n");
+		exit(1);
+	}
+	int key_fd = open(keyname, O_RDONLY);
+	if(key_fd < 0 || fstat(key_fd, &key_st) == -1 || !S_ISREG(key_st.st_mode)){
+		fprintf(stderr, "Error: the key must be a file\n");
+		exit(1);
+	}
+	long long key_length = key_st.st_size;
+	if(length > key_length){
+		fprintf(stderr, "Error: Key is too short\n");
+		exit(1);
+	}
+	// Sending the length of the file and echoing back
+	snprintf(buffer, 24, "%lld", length);
+	send(sockfd, buffer, strlen(buffer), 0);
+	recv(sockfd, buffer, 24, 0);
+	// sending the length of the key and echoing back
+	snprintf(buffer, 24, "%lld", key_length);
+	send(sockfd, buffer, strlen(buffer), 0);
+	recv(sockfd, buffer, 24, 0);
+	// the last frames are small, they should not wait for acknowledgements
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	memset(&up, 0, sizeof(up));
+	up.sockfd = sockfd;
+	up.fd = fd;
+	up.key_fd = key_fd;
+	up.key_length = key_length;
+	up.length = length;
+	if(length >= 0){
+		// the result is as long as the message, known before any of it
+		up.total = length;
+		up.done = 1;
+	}
+	if(pthread_create(&uploader, NULL, upload_frames, &up) != 0){
+		fprintf(stderr, "Error starting upload\n");
+		exit(1);
+	}
+	// get the encrypted frames back, and whatever of the finished response
+	// comes in with the last of them
+	while(ntrailer < strlen(finished)){
+		nread = recv(sockfd, buffer, sizeof(buffer), 0);
+		if(nread <= 0){
+			fprintf(stderr, "Error in receiving file\n");
+			exit(1);
+		}
+		// anything past the result is the finished response, and there can
+		// only be some once the uploader has said how long the result is
+		long long result = nread;
+		if(__atomic_load_n(&up.done, __ATOMIC_ACQUIRE) &&
+				received + result > up.total){
+			result = up.total - received;
+		}
+		write_all(out_fd, buffer, result);
+		received += result;
+		if(nread - result > (ssize_t)(sizeof(trailer) - ntrailer)){
+			fprintf(stderr, "Error in receiving file\n");
+			exit(1);
+		}
+		memcpy(trailer + ntrailer, buffer + result, nread - result);
+		ntrailer += nread - result;
+	}
+	pthread_join(uploader, NULL);
+	if(received != up.total || ntrailer != strlen(finished) ||
+			memcmp(trailer, finished, ntrailer) != 0){
+		fprintf(stderr, "Error in receiving file\n");
+		exit(1);
+	}
+	close(key_fd);
+	close(fd);
+}
+
+/*******************************************************************************
+ * void handle_local(char *, char *, int)
+ *
+ * Does what the daemon would with a small message, in this process. For a
+ * few bytes the cipher takes no time next to connecting and the round trips
+ * of the protocol, and the output is the same
+ * Args: a file name, a key name and the descriptor to write the result to
+ ******************************************************************************/
+void handle_local(char * filename, char * keyname, int out_fd){
+	int file_fd = open(filename, O_RDONLY);
+	int key_fd = open(keyname, O_RDONLY);
+	if(file_fd < 0 || key_fd < 0){
+		fprintf(stderr, "Error opening file\n");
+		exit(1);
+	}
+	long long file_length = lseek(file_fd, 0, SEEK_END);
+	long long key_length = lseek(key_fd, 0, SEEK_END);
+	if(file_length > key_length){
+		fprintf(stderr, "Error: Key is too short\n");
+		exit(1);
+	}
+	char * message = malloc(2 * file_length + 1);
+	char * key = message + file_length;
+	if(message == NULL || pread(file_fd, message, file_length, 0) != file_length ||
+			pread(key_fd, key, file_length, 0) != file_length){
+		fprintf(stderr, "Error reading file\n");
+		exit(1);
+	}
+	close(file_fd);
+	close(key_fd);
+	if(binary){
+		xor_message(message, key, file_length);
+	} else {
+		alphabet->encrypt(message, key, file_length);
+	}
+	write_all(out_fd, message, file_length);
+	free(message);
+}
+
+/*******************************************************************************
+ * int try_connect(char *, char *)
+ *
+ * Connects to the daemon like connect_to_daemon, but hands a failure back
+ * to the caller instead of exiting, so a resumable job can try again
+ * Args: the socket path or NULL, and the port number
+ * Returns: a connected socket file descriptor, or -1
+ ******************************************************************************/
+int try_connect(char * unix_path, char * port){
+	int sockfd;
+	if(unix_path != NULL){
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+		if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+			return -1;
+		}
+		if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+			close(sockfd);
+			return -1;
+		}
+		return sockfd;
+	}
+	struct addrinfo hints;
+	struct addrinfo * res;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(NULL, port, &hints, &res) != 0){
+		return -1;
+	}
+	sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if(sockfd != -1 && connect(sockfd, res->ai_addr, res->ai_addrlen) == -1){
+		close(sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo(res);
+	return sockfd;
+}
+
+/*******************************************************************************
+ * int job_send(int, int, long long, long long)
+ *
+ * Sends the part of a file from an offset to its end for a resumable job and
+ * waits for the daemon to confirm it
+ * Args: a file descriptor, a socket file descriptor, the offset and the
+ *       length of the file
+ * Returns: 0 once confirmed, -1 if the connection failed
+ ******************************************************************************/
+int job_send(int fd, int sockfd, long long offset, long long length){
+	off_t off = offset;
+	while(off < length){
+		if(sendfile(sockfd, fd, &off, length - off) <= 0){
+			return -1;
+		}
+	}
+	//read the confirmation from daemon
+	char buffer[20];
+	char * finished = "opt_enc_d f";
+	if(recv(sockfd, buffer, strlen(finished), MSG_WAITALL) != (ssize_t)strlen(finished)){
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+ * int job_attempt(int, char *, char *, char *, long long, int, long long *)
+ *
+ * Makes one attempt at a resumable job over a fresh connection, picking up
+ * from wherever the daemon and the output got to on the attempts before
+ * Args: a socket file descriptor, the job id, a file name, a key name, the
+ *       length of the file, the output descriptor and how much of the result
+ *       has been written to it, which is kept up to date
+ * Returns: 0 when the job is done, -1 if the connection failed
+ ******************************************************************************/
+int job_attempt(int sockfd, char * job, char * filename, char * keyname,
+		long long file_length, int out_fd, long long * out_have){
+	char buffer[100];
+	char to_receive[CHUNK_SIZE];
+	ssize_t nread;
+	ssize_t nwrite;
+	// verify identity and name the job
+	snprintf(buffer, sizeof(buffer), "opt_enc job=%s%s", job,
+			binary ? " xor" : "");
+	if(!binary && alphabet != &alphabets[0]){
+		snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer),
+				" alphabet=%s", alphabet->name);
+	}
+	send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+	memset(buffer, 0, sizeof(buffer));
+	if(recv(sockfd, buffer, sizeof(buffer) - 1, 0) <= 0){
+		return -1;
+	}
+	if(strcmp(buffer, "Valid") != 0){
+		fprintf(stderr,"Daemon did not accept client\n");
+		exit(1);
+	}
+	// the key only needs to be as long as the file
+	snprintf(buffer, sizeof(buffer), "%lld", file_length);
+	send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+	if(recv(sockfd, buffer, sizeof(buffer) - 1, 0) <= 0){
+		return -1;
+	}
+	snprintf(buffer, sizeof(buffer), "%lld", file_length);
+	send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+	// the daemon answers with how much of each it already has
+	memset(buffer, 0, sizeof(buffer));
+	long long msg_have;
+	long long key_have;
+	if(recv(sockfd, buffer, sizeof(buffer) - 1, 0) <= 0){
+		return -1;
+	}
+	// the id is already another client's, trying again will not help
+	if(strcmp(buffer, "Busy") == 0){
+		fprintf(stderr, "Job %s belongs to another client\n", job);
+		exit(1);
+	}
+	if(sscanf(buffer, "%lld %lld", &msg_have, &key_have) != 2){
+		return -1;
+	}
+	int file_fd = open(filename, O_RDONLY);
+	int key_fd = open(keyname, O_RDONLY);
+	if(file_fd < 0 || key_fd < 0){
+		fprintf(stderr, "Error opening file or key\n");
+		exit(1);
+	}
+	int status = job_send(file_fd, sockfd, msg_have, file_length);
+	if(status == 0){
+		status = job_send(key_fd, sockfd, key_have, file_length);
+	}
+	close(file_fd);
+	close(key_fd);
+	if(status == -1){
+		return -1;
+	}
+	// ask for the rest of the result
+	snprintf(buffer, sizeof(buffer), "%lld", *out_have);
+	send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+	while(*out_have < file_length){
+		nread = read(sockfd, to_receive, file_length - *out_have < CHUNK_SIZE ?
+				file_length - *out_have : CHUNK_SIZE);
+		if(nread <= 0){
+			return -1;
+		}
+		for(ssize_t j = 0; j < nread; j += nwrite){
+			nwrite = write(out_fd, to_receive + j, nread - j);
+			if(nwrite < 0){
+				fprintf(stderr, "Error writing output\n");
+				exit(1);
+			}
+		}
+		*out_have += nread;
+	}
+	// echo finished response so the daemon can drop the job
+	char * finished = "opt_enc_d f";
+	send(sockfd, finished, strlen(finished), MSG_NOSIGNAL);
+	return 0;
+}
+
+/*******************************************************************************
+ * void handle_job(char *, char *, char *, char *, int, int)
+ *
+ * Sends the request as a resumable job. When the connection drops, the
+ * client reconnects, backing off a little longer each time, and carries on
+ * from the last offsets the daemon and the output reached
+ * Args: the socket path or NULL, the port number, a file name, a key name,
+ *       the output descriptor and how many times to reconnect
+ ******************************************************************************/
+void handle_job(char * unix_path, char * port, char * filename, char * keyname,
+		int out_fd, int attempts){
+	struct stat file_st;
+	struct stat key_st;
+	if(stat(filename, &file_st) == -1 || stat(keyname, &key_st) == -1){
+		fprintf(stderr, "Error opening file or key\n");
+		exit(1);
+	}
+	if(file_st.st_size > key_st.st_size){
+		fprintf(stderr, "Error: Key is too short\n");
+		exit(1);
+	}
+	// name the job with random hex digits
+	unsigned char bytes[JOB_ID_SIZE / 2];
+	char job[JOB_ID_SIZE + 1];
+	int fd = open("/dev/urandom", O_RDONLY);
+	if(fd < 0 || read(fd, bytes, sizeof(bytes)) != sizeof(bytes)){
+		fprintf(stderr, "Error creating job id\n");
+		exit(1);
+	}
+	close(fd);
+	for(size_t i = 0; i < sizeof(bytes); i++){
+		sprintf(job + 2 * i, "%02x", bytes[i]);
+	}
+	// a dropped connection shows up as an error, not a signal
+	signal(SIGPIPE, SIG_IGN);
+	long long out_have = 0;
+	int attempt;
+	for(attempt = 0; ; attempt++){
+		if(attempt > 0){
+			if(attempt > attempts){
+				fprintf(stderr, "Error: gave up on job %s\n", job);
+				exit(1);
+			}
+			sleep(attempt < 5 ? 1 << (attempt - 1) : 16);
+		}
+		int sockfd = try_connect(unix_path, port);
+		if(sockfd == -1){
+			continue;
+		}
+		int status = job_attempt(sockfd, job, filename, keyname,
+				file_st.st_size, out_fd, &out_have);
+		close(sockfd);
+		if(status == 0){
+			return;
+		}
+		fprintf(stderr, "Connection lost, resuming job %s\n", job);
+	}
 }
 
 /*******************************************************************************
@@ -248,36 +1377,154 @@ void handle_request(int sockfd, char * filename, char * keyname){
  * Args: the command lin args
  ******************************************************************************/
 int main(int argc, char *argv[]){
-	// check the number of args
-	if(argc < 4){
+	// the unix domain socket path, if any
+	char * unix_path = NULL;
+	// where the result goes, stdout unless a file is given
+	int out_fd = STDOUT_FILENO;
+	// how many connections to split a large file between
+	int streams = 1;
+	// how many times a resumable request reconnects, 0 when not resumable
+	int attempts = 0;
+	// whether a file is streamed, sending and receiving at the same time
+	int duplex = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "u:o:j:r:bzl:dA:")) != -1){
+		switch(opt){
+			case 'u':
+				unix_path = optarg;
+				break;
+			case 'o':
+				// read access too, so the daemon can map it with -z
+				out_fd = open(optarg, O_RDWR | O_CREAT | O_TRUNC, 0644);
+				if(out_fd < 0){
+					fprintf(stderr, "There was an error opening %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'j':
+				streams = atoi(optarg);
+				if(streams < 1){
+					fprintf(stderr, "Invalid number of streams\n");
+					exit(1);
+				}
+				break;
+			case 'r':
+				attempts = atoi(optarg);
+				if(attempts < 1){
+					fprintf(stderr, "Invalid number of attempts\n");
+					exit(1);
+				}
+				break;
+			case 'b':
+				binary = 1;
+				break;
+			case 'z':
+				pass_fds = 1;
+				break;
+			case 'l':
+				local_threshold = strtoll(optarg, NULL, 10);
+				if(local_threshold < 0){
+					fprintf(stderr, "Invalid local threshold\n");
+					exit(1);
+				}
+				break;
+			case 'd':
+				duplex = 1;
+				break;
+			case 'A':
+				alphabet = find_alphabet(optarg);
+				if(alphabet == NULL){
+					fprintf(stderr, "Unknown alphabet %s\n", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: opt_enc [-u socketpath] [-o outfile] [-j streams] [-r attempts] [-b] [-z] [-l localbytes] [-d] [-A alphabet] filename|- keyname portnumber\n");
+				exit(1);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	// check the number of args, the port is optional with a socket path
+	if(argc < 4 && !(argc == 3 && unix_path != NULL)){
 		fprintf(stderr, "Invalid number of arguments\n");
 		fprintf(stderr, "Usage: opt_enc filename keyname portnumber\n");
 		exit(1);
 	}
-	// check for invalid chars
-	int fd = open(argv[1], O_RDONLY);
-	if(fd < 0){
+	// - is the message on stdin
+	int in_fd = strcmp(argv[1], "-") == 0 ? dup(STDIN_FILENO) : open(argv[1], O_RDONLY);
+	struct stat st;
+	if(in_fd < 0 || fstat(in_fd, &st) == -1){
 		fprintf(stderr, "There was an error opening %s\n", argv[1]);
 		exit(1);
 	}
-	check_file_and_get_length(fd);
-	close(fd);
+	// a pipe or stdin cannot be read twice or measured up front, so it is
+	// checked and sent a chunk at a time as it is read
+	chunked = strcmp(argv[1], "-") == 0 || !S_ISREG(st.st_mode);
+	// a file goes a chunk at a time with -d, unless it is small enough for -l
+	if(duplex && !chunked && st.st_size > local_threshold){
+		interleaved = 1;
+	}
+	if(!chunked){
+		// check for invalid chars
+		check_file_and_get_length(in_fd);
+		if(!interleaved){
+			close(in_fd);
+		}
+	}
 	// check for invalid chars
-	fd = open(argv[2], O_RDONLY);
+	int fd = open(argv[2], O_RDONLY);
 	if(fd < 0){
 		fprintf(stderr, "There was an error opening %s\n", argv[2]);
 		exit(1);
 	}
 	check_file_and_get_length(fd);
 	close(fd);
+	if(!chunked && st.st_size <= local_threshold){
+		// not worth a trip to the daemon
+		handle_local(argv[1], argv[2], out_fd);
+		exit(0);
+	}
+	if(chunked || interleaved){
+		if(streams > 1 || attempts > 0 || pass_fds){
+			fprintf(stderr, "Streamed input needs a single plain request\n");
+			exit(1);
+		}
+		int sockfd = connect_to_daemon(unix_path, argv[3]);
+		handle_stream(sockfd, in_fd, argv[2], out_fd,
+				chunked ? -1 : (long long)st.st_size);
+		close(sockfd);
+		exit(0);
+	}
+	if(pass_fds){
+		if(unix_path == NULL || streams > 1 || attempts > 0){
+			fprintf(stderr, "Passing files needs a socket path and a single plain request\n");
+			exit(1);
+		}
+		// nothing goes through the socket but the descriptors
+		int sockfd = connect_unix_socket(unix_path);
+		handle_fds(sockfd, argv[1], argv[2], out_fd);
+		close(sockfd);
+		exit(0);
+	}
+	if(attempts > 0){
+		if(streams > 1){
+			fprintf(stderr, "Resumable requests use a single stream\n");
+			exit(1);
+		}
+		// resume the request if the connection drops
+		handle_job(unix_path, argv[3], argv[1], argv[2], out_fd, attempts);
+		exit(0);
+	}
+	if(streams > 1){
+		// split the request between several connections
+		handle_parallel(unix_path, argv[3], argv[1], argv[2], streams, out_fd);
+		exit(0);
+	}
 	// set up socket
-	struct addrinfo * res = create_address_info(argv[3]);
-	int sockfd = create_socket(res);
-	connect_socket(sockfd, res);
+	int sockfd = connect_to_daemon(unix_path, argv[3]);
 	// handle request
-	handle_request(sockfd, argv[1], argv[2]);
-	freeaddrinfo(res);
+	handle_request(sockfd, argv[1], argv[2], out_fd);
 	close(sockfd);
 	exit(0);
 }
-
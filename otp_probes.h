@@ -0,0 +1,32 @@
+/*******************************************************************************
+ * otp_probes.h
+ *
+ * Static tracepoints in the daemons for bpftrace, perf and systemtap, under
+ * the provider otp. A probe is a single nop until something attaches to it,
+ * so they stay in release builds. List them with
+ *   bpftrace -l 'usdt:./otp_enc_d:otp:*'
+ * Without sys/sdt.h, or built with -DOTP_NO_PROBES, they compile to nothing
+ ******************************************************************************/
+#ifndef OTP_PROBES_H
+#define OTP_PROBES_H
+
+#if !defined(OTP_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define OTP_PROBES 1
+#endif
+#endif
+
+#ifdef OTP_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(otp, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(otp, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(otp, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(otp, name, a, b, c, d)
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+#endif
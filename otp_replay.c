@@ -0,0 +1,411 @@
+/*******************************************************************************
+ * otp_replay.c
+ *
+ * Replays a trace recorded by otp_enc_d or otp_dec_d -T against running
+ * daemons. Every request goes out with the same sizes and mode at the same
+ * offset from the start of the trace, sped up or as fast as possible if
+ * asked, with synthetic payloads in the recorded alphabet in place of the
+ * real ones. Prints the latencies seen once every request is back
+ ******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include "otp_cipher.h"
+
+// size of the pieces payloads are sent in
+#define CHUNK_SIZE (64 * 1024)
+// messages from this size up are reported apart from the small ones
+#define LARGE_SIZE (1024 * 1024)
+// the layout of trace records this reads
+#define TRACE_VERSION 2
+// what a trace record says about how the request was made
+#define TRACE_XOR 1
+
+/*******************************************************************************
+ * struct trace_record
+ *
+ * What the daemons' trace keeps of each request, in host byte order. Has to
+ * agree with the layout in otp_enc_d.c and otp_dec_d.c
+ ******************************************************************************/
+struct trace_record {
+	// when the request came in and how long it took, in nanoseconds
+	uint64_t arrival;
+	uint64_t duration;
+	int64_t message_length;
+	int64_t key_length;
+	// the client's IPv4 address in network byte order, or its user id when
+	// it came in on the unix domain socket
+	uint32_t client;
+	// 'e' for encryption, 'd' for decryption
+	uint8_t op;
+	uint8_t flags;
+	uint16_t version;
+	// the name of the alphabet of a text request, empty for XOR
+	char alphabet[16];
+};
+
+/*******************************************************************************
+ * struct result
+ *
+ * What a replayed request reports back to the parent through the pipe
+ ******************************************************************************/
+struct result {
+	// how long the request took, in nanoseconds
+	uint64_t latency;
+	int64_t message_length;
+	int ok;
+};
+
+// the payload a request sends, filled in with a symbol of its alphabet
+char payload[CHUNK_SIZE];
+// the latencies of the requests back so far, split by size, and how many
+// failed
+uint64_t * small = NULL;
+uint64_t * large = NULL;
+int nsmall = 0;
+int nlarge = 0;
+int failed = 0;
+
+/*******************************************************************************
+ * uint64_t now()
+ *
+ * Reads the monotonic clock
+ * Returns: the time in nanoseconds
+ ******************************************************************************/
+uint64_t now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * int connect_daemon(char *)
+ *
+ * Connects to a daemon on the local host
+ * Args: a port number, or the path of a unix domain socket
+ * Returns: a socket file descriptor, or -1 if it could not connect
+ ******************************************************************************/
+int connect_daemon(char * target){
+	int sockfd;
+	if(strchr(target, '/') != NULL){
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, target, sizeof(addr.sun_path) - 1);
+		if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+			return -1;
+		}
+		if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+			close(sockfd);
+			return -1;
+		}
+		return sockfd;
+	}
+	struct addrinfo hints;
+	struct addrinfo * res;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(NULL, target, &hints, &res) != 0){
+		return -1;
+	}
+	sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if(sockfd != -1 && connect(sockfd, res->ai_addr, res->ai_addrlen) == -1){
+		close(sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo(res);
+	return sockfd;
+}
+
+/*******************************************************************************
+ * int send_payload(int, long long)
+ *
+ * Sends a synthetic file of a given length and waits for the daemon to say
+ * it got all of it
+ * Args: a socket file descriptor and the length
+ * Returns: 0 on success, -1 if the connection failed
+ ******************************************************************************/
+int send_payload(int sockfd, long long length){
+	char buffer[20];
+	char * finished = "opt_enc_d f";
+	ssize_t nwrote;
+	long long i = 0;
+	for(; i < length; i += nwrote){
+		nwrote = write(sockfd, payload,
+				length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE);
+		if(nwrote <= 0){
+			return -1;
+		}
+	}
+	memset(buffer, 0, sizeof(buffer));
+	if(recv(sockfd, buffer, strlen(finished), MSG_WAITALL) !=
+			(ssize_t)strlen(finished)){
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+ * int replay(struct trace_record *, char *)
+ *
+ * Makes the request a record describes, as a plain request of the same
+ * sizes and alphabet, its payload repeating the alphabet's first symbol.
+ * Resumable, streamed and descriptor passing requests are replayed plain too
+ * Args: the record and the daemon to send it to
+ * Returns: 0 on success, -1 if the request failed
+ ******************************************************************************/
+int replay(struct trace_record * record, char * target){
+	char buffer[CHUNK_SIZE];
+	char identity[64];
+	ssize_t nread;
+	long long i;
+	const struct alphabet * alphabet = find_alphabet(record->alphabet);
+	int sockfd = connect_daemon(target);
+	if(sockfd == -1){
+		return -1;
+	}
+	// the default alphabet goes unnamed, like the clients leave it
+	snprintf(identity, sizeof(identity), "%s%s%s%s",
+			record->op == 'd' ? "opt_dec" : "opt_enc",
+			record->flags & TRACE_XOR ? " xor" : "",
+			alphabet != NULL && alphabet != &alphabets[0] ? " alphabet=" : "",
+			alphabet != NULL && alphabet != &alphabets[0] ? alphabet->name : "");
+	memset(payload, alphabet != NULL ? alphabet->symbols[0] : 'A',
+			sizeof(payload));
+	send(sockfd, identity, strlen(identity), 0);
+	memset(buffer, 0, 100);
+	if(recv(sockfd, buffer, 99, 0) <= 0 || strcmp(buffer, "Valid") != 0){
+		close(sockfd);
+		return -1;
+	}
+	// the lengths, each echoed back
+	snprintf(buffer, 24, "%lld", (long long)record->message_length);
+	send(sockfd, buffer, strlen(buffer), 0);
+	recv(sockfd, buffer, 24, 0);
+	snprintf(buffer, 24, "%lld", (long long)record->key_length);
+	send(sockfd, buffer, strlen(buffer), 0);
+	if(recv(sockfd, buffer, 24, 0) <= 0 ||
+			send_payload(sockfd, record->message_length) == -1 ||
+			send_payload(sockfd, record->key_length) == -1){
+		close(sockfd);
+		return -1;
+	}
+	// take the result back and throw it away
+	for(i = 0; i < record->message_length; i += nread){
+		nread = read(sockfd, buffer,
+				record->message_length - i < CHUNK_SIZE ?
+				record->message_length - i : CHUNK_SIZE);
+		if(nread <= 0){
+			close(sockfd);
+			return -1;
+		}
+	}
+	char * finished = "opt_enc_d f";
+	send(sockfd, finished, strlen(finished), 0);
+	close(sockfd);
+	return 0;
+}
+
+/*******************************************************************************
+ * void collect(int)
+ *
+ * Waits for the next request to come back and files its latency
+ * Args: the read end of the results pipe
+ ******************************************************************************/
+void collect(int results_fd){
+	struct result result;
+	if(read(results_fd, &result, sizeof(result)) != sizeof(result)){
+		fprintf(stderr, "Error reading results\n");
+		exit(1);
+	}
+	if(!result.ok){
+		failed++;
+	}
+	else if(result.message_length < LARGE_SIZE){
+		small[nsmall++] = result.latency;
+	}
+	else{
+		large[nlarge++] = result.latency;
+	}
+}
+
+/*******************************************************************************
+ * int compare_records(const void *, const void *)
+ *
+ * Orders trace records by arrival, for qsort
+ ******************************************************************************/
+int compare_records(const void * a, const void * b){
+	uint64_t x = ((const struct trace_record *)a)->arrival;
+	uint64_t y = ((const struct trace_record *)b)->arrival;
+	return x < y ? -1 : x > y;
+}
+
+/*******************************************************************************
+ * int compare_latencies(const void *, const void *)
+ *
+ * Orders latencies, for qsort
+ ******************************************************************************/
+int compare_latencies(const void * a, const void * b){
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*******************************************************************************
+ * void report(char *, uint64_t *, int)
+ *
+ * Prints how many requests there were and their latency percentiles
+ * Args: a label, the latencies in nanoseconds and how many there are
+ ******************************************************************************/
+void report(char * label, uint64_t * latencies, int n){
+	if(n == 0){
+		return;
+	}
+	qsort(latencies, n, sizeof(uint64_t), compare_latencies);
+	printf("%-8s %8d requests  p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  max %9.3f ms\n",
+			label, n, latencies[n / 2] / 1e6, latencies[n * 9 / 10] / 1e6,
+			latencies[n * 99 / 100] / 1e6, latencies[n - 1] / 1e6);
+}
+
+/*******************************************************************************
+ * int main(int, char*)
+ *
+ * main method. reads the trace, replays it and reports
+ * Args: the command line args
+ ******************************************************************************/
+int main(int argc, char *argv[]){
+	// how many times faster than recorded, 0 for as fast as possible
+	double speed = 1;
+	// how many requests can be out at once
+	int inflight = 64;
+	int opt;
+	while((opt = getopt(argc, argv, "s:p:")) != -1){
+		switch(opt){
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'p':
+				inflight = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: otp_replay [-s speed] [-p inflight] tracefile encdaemon decdaemon\n");
+				exit(1);
+		}
+	}
+	if(argc - optind != 3 || speed < 0 || inflight < 1){
+		fprintf(stderr, "Usage: otp_replay [-s speed] [-p inflight] tracefile encdaemon decdaemon\n");
+		exit(1);
+	}
+	// read the whole trace
+	int fd = open(argv[optind], O_RDONLY);
+	if(fd < 0){
+		fprintf(stderr, "There was an error opening %s\n", argv[optind]);
+		exit(1);
+	}
+	off_t size = lseek(fd, 0, SEEK_END);
+	int nrecords = size / sizeof(struct trace_record);
+	struct trace_record * records = malloc(nrecords * sizeof(struct trace_record) + 1);
+	if(records == NULL || pread(fd, records, nrecords * sizeof(struct trace_record), 0) !=
+			(ssize_t)(nrecords * sizeof(struct trace_record))){
+		fprintf(stderr, "Error reading trace\n");
+		exit(1);
+	}
+	close(fd);
+	int i;
+	for(i = 0; i < nrecords; i++){
+		if(records[i].version != TRACE_VERSION || records[i].message_length < 0 ||
+				records[i].key_length < records[i].message_length){
+			fprintf(stderr, "%s is not a trace this can replay\n", argv[optind]);
+			exit(1);
+		}
+		records[i].alphabet[sizeof(records[i].alphabet) - 1] = '\0';
+		if(!(records[i].flags & TRACE_XOR) &&
+				find_alphabet(records[i].alphabet) == NULL){
+			fprintf(stderr, "%s uses the alphabet %s, which this was not built with\n",
+					argv[optind], records[i].alphabet);
+			exit(1);
+		}
+	}
+	// processes finishing at the same time can record out of order
+	qsort(records, nrecords, sizeof(struct trace_record), compare_records);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN);
+	// every request reports back through a pipe
+	int results[2];
+	if(pipe(results) == -1){
+		fprintf(stderr, "Error creating pipe\n");
+		exit(1);
+	}
+	small = malloc(nrecords * sizeof(uint64_t) + 1);
+	large = malloc(nrecords * sizeof(uint64_t) + 1);
+	if(small == NULL || large == NULL){
+		fprintf(stderr, "Error allocating results\n");
+		exit(1);
+	}
+	int out = 0;
+	int late = 0;
+	struct result result;
+	uint64_t start = now();
+	for(i = 0; i < nrecords; i++){
+		// keep to the recorded spacing, scaled
+		if(speed > 0){
+			uint64_t due = start + (records[i].arrival - records[0].arrival) / speed;
+			uint64_t t = now();
+			if(t < due){
+				struct timespec ts = {(due - t) / 1000000000, (due - t) % 1000000000};
+				nanosleep(&ts, NULL);
+			}
+			else if(t - due > 1000000){
+				// more than a millisecond behind
+				late++;
+			}
+		}
+		// wait for a request to come back when too many are out
+		for(; out >= inflight; out--){
+			collect(results[0]);
+		}
+		pid_t pid = fork();
+		if(pid == -1){
+			fprintf(stderr, "Error in fork\n");
+			exit(1);
+		}
+		if(pid == 0){
+			close(results[0]);
+			uint64_t begin = now();
+			result.ok = replay(&records[i],
+					records[i].op == 'd' ? argv[optind + 2] : argv[optind + 1]) == 0;
+			result.latency = now() - begin;
+			result.message_length = records[i].message_length;
+			// one small write, so results from different children do not mix
+			if(write(results[1], &result, sizeof(result)) != sizeof(result)){
+				_Exit(1);
+			}
+			_Exit(0);
+		}
+		out++;
+	}
+	for(; out > 0; out--){
+		collect(results[0]);
+	}
+	double elapsed = (now() - start) / 1e9;
+	printf("replayed %d requests in %.3f s, %.1f per second, %d failed, %d started late\n",
+			nrecords, elapsed, elapsed > 0 ? nrecords / elapsed : 0, failed, late);
+	report("small", small, nsmall);
+	report("large", large, nlarge);
+	free(records);
+	free(small);
+	free(large);
+	return failed > 0;
+}